@@ -0,0 +1,93 @@
+#include "evaluator.hpp"
+#include "negaalpha.hpp"
+#include "parallel_negascout.hpp"
+#include "quoridor_fast.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+/*!
+ * 探索中のヒープ確保の回数を数える。
+ * 局面ファイルの各局面を深さdepthまで反復深化で探索し、1ノードあたりのoperator newの回数とバイト数を出力する。
+ * threadsが2以上なら、--splitと同じYBWの並列探索で数える。
+ *
+ * Usage: alloc-count <局面ファイル> [depth] [threads]
+ */
+
+namespace
+{
+std::atomic<std::size_t> allocations = 0;
+std::atomic<std::size_t> allocated_bytes = 0;
+}  // namespace
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    allocated_bytes += size;
+    if (void* p = std::malloc(size == 0 ? 1 : size))
+        return p;
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: alloc-count <position-file> [depth] [threads]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int depth = argc >= 3 ? std::stoi(argv[2]) : 4;
+    int threads = argc >= 4 ? std::max(1, std::stoi(argv[3])) : 1;
+
+    std::vector<QuoridorFast::State> positions;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        positions.push_back(s);
+    }
+
+    const QuoridorFast::Evaluate eval;
+    hash_table<QuoridorFast::State>.resize(16);
+    SearchContext<QuoridorFast::State> ctx;
+    SplitSearch<QuoridorFast::State> search(threads);
+
+    // 置換表と探索状態の確保が済んでから数える
+    allocations = allocated_bytes = 0;
+    for (auto& s : positions) {
+        hash_table<QuoridorFast::State>.clear();
+        for (int i = 1; i <= depth; i++) {
+            if (threads > 1) {
+                iterativeDeepeningParallelNegascout(search, s, eval, i, i - 1, [] { return false; });
+            } else {
+                iterativeDeepeningNegascout(ctx, s, eval, i, i - 1, [] { return false; });
+            }
+        }
+    }
+    const std::size_t counted = allocations, counted_bytes = allocated_bytes;
+    uint64_t nodes = ctx.nodes;
+    for (auto& c : search.contexts) {
+        nodes += c.nodes;
+    }
+
+    std::cout << "Positions: " << positions.size() << ", depth: " << depth << ", threads: " << threads << '\n'
+              << "nodes: " << nodes << ", allocations: " << counted << ", bytes: " << counted_bytes << '\n'
+              << "allocations/node: " << double(counted) / double(nodes)
+              << ", bytes/node: " << double(counted_bytes) / double(nodes) << std::endl;
+    return 0;
+}
@@ -0,0 +1,412 @@
+#pragma once
+#include "evaluator.hpp"
+#include "negaalpha.hpp"
+#include "quoridor_fast.hpp"
+#include "time_manager.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <netinet/in.h>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+/*!
+ * negascout-fast --serveで使う、局面を分析するサーバー。
+ * ローカルのソケットで接続を1つずつ受け付け、1行1要求のテキストで要求を受け取り、結果をJSONの1行ずつで返す。
+ * 置換表は要求をまたいで使い続けるので、似た局面を続けて分析すると速い。
+ *
+ * 要求(空白で区切った語の並びで、改行の位置は問わない):
+ *   analyze [depth D] [movetime MS] [multipv K] position <局面>
+ *       局面はテキストの形式(数70個)。depthもmovetimeもなければ、エンジンの--movetimeなどの持ち時間で探索する。
+ *       depthだけなら時間の制限なしでその深さまで探索する。
+ *       深さを1つ探索し終えるたびに、K個の手それぞれについて
+ *       {"depth":D,"multipv":k,"score":S,"nodes":N,"ms":T,"pv":["MOVE 4 7",...]} を返し、最後に
+ *       {"bestmove":"MOVE 4 7","score":S,"depth":D,"nodes":N,"ms":T} を返す。nodesとmsはその要求の中での累計。
+ *   clear  置換表を空にする。{"ok":true}を返す
+ *   quit   接続を閉じる
+ * 読めない要求には{"error":"..."}を返し、その行の残りを捨てる。
+ */
+namespace AnalysisServer
+{
+using QuoridorFast::State;
+
+/*!
+ * addressで待ち受けるソケットを作る。"unix:<パス>"ならUnixドメインソケット、そうでなければ127.0.0.1のTCPのポート番号。
+ * 作れなければエラーを出力して-1を返す。
+ */
+inline int listenOn(const std::string& address)
+{
+    int fd;
+    if (address.rfind("unix:", 0) == 0) {
+        const std::string path = address.substr(5);
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "socket path too long: " << path << std::endl;
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        std::strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::cerr << "cannot bind " << path << ": " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+    } else {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(static_cast<uint16_t>(std::stoi(address)));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int yes = 1;
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            std::cerr << "cannot bind port " << address << ": " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+    }
+    if (listen(fd, 8) != 0) {
+        std::cerr << "cannot listen: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    return fd;
+}
+
+/*!
+ * 受け付けた1つの接続。空白で区切られた語を読み、行を書く。
+ */
+class Connection
+{
+public:
+    explicit Connection(int fd) : fd(fd) {}
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+    ~Connection()
+    {
+        close(fd);
+    }
+
+    //! 次の語。接続が閉じたらstd::nullopt
+    std::optional<std::string> token()
+    {
+        while (true) {
+            const auto begin = std::find_if(buffer.begin(), buffer.end(), [](char c) { return !std::isspace(static_cast<unsigned char>(c)); });
+            const auto end = std::find_if(begin, buffer.end(), [](char c) { return std::isspace(static_cast<unsigned char>(c)); });
+            if (end != buffer.end()) {
+                std::string t(begin, end);
+                buffer.erase(buffer.begin(), end);
+                return t;
+            }
+            char chunk[4096];
+            const ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+                return std::nullopt;
+            buffer.append(chunk, std::size_t(n));
+        }
+    }
+
+    //! 今の行の残りを捨てる。読めない要求の後に、次の行から読み直すのに使う
+    void skipLine()
+    {
+        while (true) {
+            const auto newline = buffer.find('\n');
+            if (newline != std::string::npos) {
+                buffer.erase(0, newline + 1);
+                return;
+            }
+            buffer.clear();
+            char chunk[4096];
+            const ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n <= 0)
+                return;
+            buffer.append(chunk, std::size_t(n));
+        }
+    }
+
+    //! 1行書く。相手が閉じていたらfalseを返し、以後も書かない
+    bool writeLine(const std::string& line)
+    {
+        const std::string data = line + '\n';
+        for (std::size_t sent = 0; open && sent < data.size();) {
+            const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                open = false;
+            else
+                sent += std::size_t(n);
+        }
+        return open;
+    }
+
+    bool isOpen() const
+    {
+        return open;
+    }
+
+private:
+    int fd;
+    std::string buffer;  //! 読んだが、まだ語として返していない文字
+    bool open = true;
+};
+
+struct Request {
+    State state;
+    std::optional<int> depth;
+    std::optional<int64_t> move_time;
+    int multipv = 1;
+};
+
+//! 語全体が範囲内の整数ならその値。"3x"のように後ろに余計な文字があるものは読まない
+template <class T>
+std::optional<T> parseInteger(const std::string& token)
+{
+    T value{};
+    const char* const end = token.data() + token.size();
+    const auto [ptr, ec] = std::from_chars(token.data(), end, value);
+    if (ec != std::errc{} || ptr != end)
+        return std::nullopt;
+    return value;
+}
+
+/*!
+ * "analyze"に続く引数と局面を読む。読めなければerrorに理由を入れてstd::nullopt
+ */
+inline std::optional<Request> readAnalyze(Connection& conn, std::string& error)
+{
+    Request req;
+    while (true) {
+        const auto key = conn.token();
+        if (!key) {
+            error = "unexpected end of input";
+            return std::nullopt;
+        }
+        if (*key == "position")
+            break;
+        const auto value = conn.token();
+        if (!value) {
+            error = "unexpected end of input";
+            return std::nullopt;
+        }
+        const auto number = parseInteger<int64_t>(*value);
+        if (!number) {
+            error = "invalid number: " + *value;
+            return std::nullopt;
+        }
+        if (*key == "depth") {
+            req.depth = int(std::clamp<int64_t>(*number, 1, MAX_DEPTH - 1));
+        } else if (*key == "movetime") {
+            req.move_time = std::max<int64_t>(1, *number);
+        } else if (*key == "multipv") {
+            req.multipv = int(std::clamp<int64_t>(*number, 1, std::numeric_limits<int>::max()));
+        } else {
+            error = "unknown option: " + *key;
+            return std::nullopt;
+        }
+    }
+    // 駒の座標4つ、残りの壁2つ、壁の置き場所8x8の順。読み込む前に値の範囲を調べる
+    std::string text;
+    for (int i = 0; i < 6 + (QuoridorFast::N - 1) * (QuoridorFast::N - 1); i++) {
+        const auto t = conn.token();
+        if (!t) {
+            error = "unexpected end of input";
+            return std::nullopt;
+        }
+        const auto value = parseInteger<int>(*t);
+        if (!value) {
+            error = "invalid number: " + *t;
+            return std::nullopt;
+        }
+        if (i < 4 && (*value < 0 || *value >= QuoridorFast::N)) {
+            error = "invalid position";
+            return std::nullopt;
+        }
+        if (4 <= i && i < 6 && (*value < 0 || *value > QuoridorFast::Evaluate::MAX_WALLS)) {
+            error = "invalid number of walls";
+            return std::nullopt;
+        }
+        text += *t + ' ';
+    }
+    std::istringstream in(text);
+    in >> req.state;
+    if (!in) {
+        error = "invalid position";
+        return std::nullopt;
+    }
+    return req;
+}
+
+//! valueを出力した文字列を、JSONの文字列にする
+template <class T>
+std::string jsonString(const T& value)
+{
+    std::ostringstream os;
+    os << value;
+    std::string ret = "\"";
+    for (char c : os.str()) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if (static_cast<unsigned char>(c) >= 0x20) {
+            ret += c;
+        }
+    }
+    return ret + '"';
+}
+
+/*!
+ * 最良手テーブルの根の行をたどって読み筋の手を並べる。勝負のついた局面か、無効なインデックスで終わる。
+ */
+inline std::vector<State::NextMove> principalVariation(const SearchContext<State>& ctx, State s, int depth)
+{
+    std::vector<State::NextMove> pv;
+    for (int i = 0; i < depth && !s.lose(); i++) {
+        const int index = ctx.best_path_table[0][i];
+        if (index < 0)
+            break;
+        int count = 0;
+        std::optional<std::pair<State::NextMove, State>> found;
+        s.forEachMove([&](const State::NextMove& m, const State& next) {
+            if (count++ == index)
+                found.emplace(m, next);
+        });
+        if (!found)
+            break;
+        pv.push_back(found->first);
+        s = found->second;
+    }
+    return pv;
+}
+
+/*!
+ * reqの局面をctxで分析し、結果をconnに書く。
+ * 深さごとに、まず普通に探索して1番目の手を決め、2番目以降は先に見つけた手を根で除いて探索する。
+ * 除いて探索するときは、1番目の手の探索の評価値と最良手テーブルを次の深さの探索に引き継ぐため、探索窓を使わず、終わったら元に戻す。
+ * @param default_time depthもmovetimeもないときの持ち時間
+ */
+template <class FEval>
+void analyze(Connection& conn, SearchContext<State>& ctx, const FEval& eval, const Request& req, int max_depth, const TimeControl& default_time)
+{
+    TimeControl tc = default_time;
+    if (req.move_time) {
+        tc = TimeControl{};
+        tc.move_time = *req.move_time;
+    } else if (req.depth) {
+        tc = TimeControl{};
+        tc.move_time = 0;
+    }
+    TimeManager time_manager(tc, QuoridorFast::default_weights.step);
+    time_manager.startTurn();
+    ctx.table->newTurn();
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t start_nodes = ctx.nodes;
+    auto stop = [&] { return time_manager.stop() || !conn.isOpen(); };
+    auto elapsed = [&] { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+
+    int moves = 0;
+    req.state.forEachMove([&](const State::NextMove&, const State&) { moves++; });
+    const int multipv = std::min(req.multipv, moves);
+    const int target = std::min(req.depth.value_or(max_depth), max_depth);
+
+    std::optional<State::NextMove> best;
+    TScore best_score = -INF;
+    int completed = 0;
+    for (int depth = 1; depth <= target && !req.state.lose(); depth++) {
+        bool aborted = false;
+        std::vector<int> first_path(ctx.best_path_table[0], ctx.best_path_table[0] + MAX_DEPTH);
+        for (int k = 0; k < multipv; k++) {
+            const auto saved_scores = ctx.iteration_scores;
+            const TScore saved_window = ctx.aspiration_window;
+            if (k > 0)
+                ctx.aspiration_window = 0;
+            auto res = iterativeDeepeningNegascout(ctx, req.state, eval, depth, depth - 1, stop);
+            if (k > 0) {
+                ctx.iteration_scores = saved_scores;
+                ctx.aspiration_window = saved_window;
+            }
+            if (res.aborted) {
+                // 1番目の手は、打ち切るまでに見つかっていれば使う
+                if (k == 0 && res.hasMove()) {
+                    best = res.getMove();
+                    best_score = res.score;
+                }
+                aborted = true;
+                break;
+            }
+            if (!res.hasMove())
+                break;
+            const auto pv = principalVariation(ctx, req.state, depth);
+            ctx.root_excluded.push_back(ctx.best_path_table[0][0]);
+            if (k == 0) {
+                std::copy(ctx.best_path_table[0], ctx.best_path_table[0] + MAX_DEPTH, first_path.begin());
+                best = res.getMove();
+                best_score = res.score;
+            }
+            std::ostringstream line;
+            line << "{\"depth\":" << depth << ",\"multipv\":" << k + 1 << ",\"score\":" << res.score << ",\"nodes\":" << ctx.nodes - start_nodes
+                 << ",\"ms\":" << elapsed() << ",\"pv\":[";
+            for (std::size_t i = 0; i < pv.size(); i++) {
+                line << (i == 0 ? "" : ",") << jsonString(pv[i]);
+            }
+            line << "]}";
+            conn.writeLine(line.str());
+        }
+        ctx.root_excluded.clear();
+        std::copy(first_path.begin(), first_path.end(), ctx.best_path_table[0]);
+        if (aborted)
+            break;
+        completed = depth;
+        if (!time_manager.onIteration(depth, ctx.best_path_table[0][0], best_score))
+            break;
+    }
+    std::ostringstream line;
+    line << "{\"bestmove\":" << (best ? jsonString(*best) : std::string("null")) << ",\"score\":" << (best ? best_score : -INF)
+         << ",\"depth\":" << completed << ",\"nodes\":" << ctx.nodes - start_nodes << ",\"ms\":" << elapsed() << '}';
+    conn.writeLine(line.str());
+}
+
+/*!
+ * listen_fdで接続を1つずつ受け付け、要求を処理し続ける。
+ */
+template <class FEval>
+void serve(int listen_fd, SearchContext<State>& ctx, const FEval& eval, int max_depth, const TimeControl& default_time)
+{
+    while (true) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        std::cerr << "client connected" << std::endl;
+        Connection conn(fd);
+        while (conn.isOpen()) {
+            const auto command = conn.token();
+            if (!command || *command == "quit")
+                break;
+            if (*command == "analyze") {
+                std::string error;
+                if (auto req = readAnalyze(conn, error)) {
+                    analyze(conn, ctx, eval, *req, max_depth, default_time);
+                } else {
+                    conn.skipLine();
+                    conn.writeLine("{\"error\":" + jsonString(error) + "}");
+                }
+            } else if (*command == "clear") {
+                ctx.table->clear();
+                conn.writeLine("{\"ok\":true}");
+            } else {
+                conn.skipLine();
+                conn.writeLine("{\"error\":" + jsonString("unknown command: " + *command) + "}");
+            }
+        }
+        std::cerr << "client disconnected" << std::endl;
+    }
+}
+}  // namespace AnalysisServer
@@ -0,0 +1,100 @@
+#include "evaluator.hpp"
+#include "negaalpha.hpp"
+#include "quoridor_fast.hpp"
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*!
+ * negascout-fastの探索の回帰テスト用ベンチマーク。
+ * 局面ファイルの各局面を、置換表と探索状態を空にしてから深さdepthまで反復深化で探索し、
+ * 局面ごとのノード数、深さdepthに届くまでの時間、最善手と評価値を出力する。
+ * 最後に全体のノード数、NPS、深さごとに届くまでの時間の合計と、各局面のノード数・最善手・評価値から作るシグネチャを出力する。
+ * NORANDOMでビルドするので、探索が変わらなければノード数とシグネチャは毎回同じになる。
+ *
+ * Usage: bench <局面ファイル> [depth] [hash_MB]
+ */
+
+namespace
+{
+//! シグネチャ用のFNV-1a
+struct Signature {
+    uint64_t value = 14695981039346656037ull;
+
+    void add(const std::string& s)
+    {
+        for (unsigned char c : s) {
+            value = (value ^ c) * 1099511628211ull;
+        }
+        value = (value ^ 0xff) * 1099511628211ull;
+    }
+};
+}  // namespace
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: bench <position-file> [depth] [hash_MB]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int depth = argc >= 3 ? std::stoi(argv[2]) : 6;
+    std::size_t hash_mb = argc >= 4 ? std::stoul(argv[3]) : 16;
+    if (depth < 1 || depth > MAX_DEPTH) {
+        std::cerr << "depth must be in [1, " << MAX_DEPTH << "]" << std::endl;
+        return 1;
+    }
+
+    std::vector<QuoridorFast::State> positions;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        positions.push_back(s);
+    }
+    hash_table<QuoridorFast::State>.resize(hash_mb);
+    const QuoridorFast::Evaluate eval;
+
+    std::cout << "Positions: " << positions.size() << ", depth: " << depth << ", hash: " << hash_mb << " MB\n";
+    std::cout << "position         nodes     time[ms]  result\n";
+    uint64_t total_nodes = 0;
+    double total_ms = 0;
+    std::vector<double> depth_ms(depth + 1);  //! 深さごとに、そこまで探索し終えるまでの時間の合計
+    Signature signature;
+    for (int p = 0; p < int(positions.size()); p++) {
+        hash_table<QuoridorFast::State>.clear();
+        auto ctx = std::make_unique<SearchContext<QuoridorFast::State>>();
+        auto start = std::chrono::steady_clock::now();
+        Result<QuoridorFast::State> res = {};
+        for (int i = 1; i <= depth; i++) {
+            res = iterativeDeepeningNegascout(*ctx, positions[p], eval, i, i - 1, [] { return false; });
+            depth_ms[i] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        total_ms += ms;
+        total_nodes += ctx->nodes;
+
+        std::ostringstream result;
+        result << res.getMove() << ' ' << res.score;
+        signature.add(std::to_string(ctx->nodes) + ' ' + result.str());
+        std::cout << std::setw(8) << p << std::setw(14) << ctx->nodes << std::setw(13) << std::fixed << std::setprecision(1) << ms << "  " << result.str() << '\n';
+    }
+
+    std::cout << "Time to depth:";
+    for (int i = 1; i <= depth; i++) {
+        std::cout << ' ' << i << ':' << std::fixed << std::setprecision(1) << depth_ms[i] << "ms";
+    }
+    std::cout << '\n';
+    std::cout << "Nodes searched: " << total_nodes << '\n'
+              << "Time: " << std::fixed << std::setprecision(1) << total_ms << " ms\n"
+              << "NPS: " << uint64_t(total_nodes / (total_ms / 1000)) << '\n'
+              << "Signature: " << std::hex << std::setw(16) << std::setfill('0') << signature.value << std::endl;
+    return 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <fcntl.h>
+#include <optional>
+#include <poll.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*!
+ * 子プロセスとして動かすエンジン。標準入力と標準出力をパイプでつなぐ。
+ * コマンドは/bin/shで実行する。標準エラー出力はshow_stderrでなければ捨てる。
+ * 破棄すると子プロセスを終了させる。
+ */
+class EngineProcess
+{
+public:
+    EngineProcess(const std::string& command, bool show_stderr)
+    {
+        int to_child[2], from_child[2];
+        if (pipe2(to_child, O_CLOEXEC) != 0)
+            return;
+        if (pipe2(from_child, O_CLOEXEC) != 0) {
+            close(to_child[0]), close(to_child[1]);
+            return;
+        }
+        // forkした後はexecまでの間にメモリを確保できないので、引数は先に作っておく
+        const std::string script = "exec " + command;
+        const int null_fd = show_stderr ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+        pid = fork();
+        if (pid == 0) {
+            dup2(to_child[0], STDIN_FILENO);
+            dup2(from_child[1], STDOUT_FILENO);
+            if (null_fd >= 0)
+                dup2(null_fd, STDERR_FILENO);
+            execl("/bin/sh", "sh", "-c", script.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        close(to_child[0]);
+        close(from_child[1]);
+        if (null_fd >= 0)
+            close(null_fd);
+        if (pid < 0) {
+            close(to_child[1]), close(from_child[0]);
+            return;
+        }
+        to_fd = to_child[1];
+        from_fd = from_child[0];
+    }
+    EngineProcess(const EngineProcess&) = delete;
+    EngineProcess& operator=(const EngineProcess&) = delete;
+
+    ~EngineProcess()
+    {
+        if (to_fd >= 0)
+            close(to_fd);
+        if (from_fd >= 0)
+            close(from_fd);
+        if (pid > 0) {
+            kill(pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    //! dataを送る。送れなければfalse
+    bool send(const std::string& data)
+    {
+        for (std::size_t sent = 0; sent < data.size();) {
+            const ssize_t n = write(to_fd, data.data() + sent, data.size() - sent);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            sent += std::size_t(n);
+        }
+        return true;
+    }
+
+    /*!
+     * 1行受け取る。deadlineを過ぎるか、エンジンが終了するか、abortがtrueを返したらstd::nullopt。
+     * abortは100msごとに呼ぶ。
+     */
+    template <class F>
+    std::optional<std::string> receiveLine(std::chrono::steady_clock::time_point deadline, const F& abort)
+    {
+        std::size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos) {
+            if (!fill(deadline, abort))
+                return std::nullopt;
+        }
+        std::string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        return line;
+    }
+
+    //! sizeバイト受け取る。受け取れないときはreceiveLineと同じ
+    template <class F>
+    std::optional<std::string> receiveBytes(std::size_t size, std::chrono::steady_clock::time_point deadline, const F& abort)
+    {
+        while (buffer.size() < size) {
+            if (!fill(deadline, abort))
+                return std::nullopt;
+        }
+        std::string data = buffer.substr(0, size);
+        buffer.erase(0, size);
+        return data;
+    }
+
+    bool running() const
+    {
+        return pid > 0 && to_fd >= 0 && from_fd >= 0;
+    }
+
+    //! エンジンの標準入力につながったfd。非同期に読み書きするときに使う
+    int inputFd() const
+    {
+        return to_fd;
+    }
+
+    //! エンジンの標準出力につながったfd
+    int outputFd() const
+    {
+        return from_fd;
+    }
+
+private:
+    //! 出力を待って読めただけbufferに足す。deadlineを過ぎるか、エンジンが終了するか、abortがtrueを返したらfalse
+    template <class F>
+    bool fill(std::chrono::steady_clock::time_point deadline, const F& abort)
+    {
+        while (true) {
+            const auto now = std::chrono::steady_clock::now();
+            if (now >= deadline || abort() || from_fd < 0)
+                return false;
+            const int wait_ms = int(std::min<int64_t>(100, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1));
+            pollfd pfd{from_fd, POLLIN, 0};
+            const int ready = poll(&pfd, 1, wait_ms);
+            if (ready < 0 && errno != EINTR)
+                return false;
+            if (ready <= 0)
+                continue;
+            char chunk[256];
+            const ssize_t n = read(from_fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            buffer.append(chunk, std::size_t(n));
+            return true;
+        }
+    }
+
+    pid_t pid = -1;
+    int to_fd = -1;
+    int from_fd = -1;
+    std::string buffer;  //! 受け取ったが、まだ行になっていない出力
+};
@@ -0,0 +1,127 @@
+#pragma once
+#include "negaalpha.hpp"
+#include "quoridor_fast.hpp"
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/*!
+ * negascout-fast --binaryで使う、テキストの盤面の代わりのバイナリのプロトコル。
+ * 毎手番に盤面全体を送るのではなく、最初に局面を1回送った後は相手の手だけを送る。
+ * エンジンは局面、置換表、ponderの探索を手番をまたいで持ち続ける。
+ *
+ * メッセージは1バイトの種類の後に中身が続く。整数はリトルエンディアン。
+ * クライアントからエンジンへ:
+ *   'P' 局面(STATE_SIZEバイト)    この局面(エンジンの手番)から対局を始め、手を返させる
+ *   'M' 手(1バイト)                直前にエンジンが指した後の局面で相手が指した手。その後の局面の手を返させる
+ *   'A' 深さ(1バイト) 数(2バイト) 局面×数   各局面を指定した深さまで探索させる(分析)
+ *   'Q'                            終了させる
+ * エンジンからクライアントへ:
+ *   'M' 手(1バイト)                'P'か'M'に対する手
+ *   'A' 数(2バイト) (手(1バイト) 評価値(4バイト) 深さ(1バイト))×数   'A'に対する結果。勝負のついた局面は手がNO_MOVE(127)で深さ0
+ *   'E' 理由(1バイト)              読めないメッセージや、局面がないのに'M'を受け取ったとき
+ *
+ * 手は1バイトで、駒を動かす手はy * 9 + x、壁を置く手は128 + 向き * 64 + y * 8 + x(向きは横が0、縦が1)。
+ * 81から127はどの手でもなく、decodeMoveは読めない値として扱う。
+ * 局面は自分の駒のx, y、相手の駒のx, y、自分と相手の残りの壁の数の6バイトの後に、
+ * 8x8の壁の置き場所をy * 8 + xの順に2ビットずつ(0: なし、1: 横、2: 縦)下位ビットから詰めた16バイト。
+ * 局面はいつも手番の側から見たもので、テキストの形式と同じ。
+ */
+namespace EngineProtocol
+{
+using QuoridorFast::N;
+using QuoridorFast::Position;
+using QuoridorFast::State;
+using QuoridorFast::WallDirection;
+
+constexpr std::size_t STATE_SIZE = 22;
+constexpr uint8_t NO_MOVE = 127;  //!< 手がないことを表す。手の値の範囲の外にとる
+
+enum class Error : uint8_t {
+    BadMessage = 1,  //!< 知らない種類か、中身が範囲外
+    NoPosition = 2,  //!< 'M'を受け取ったが、続きの局面がないか、手が反則
+};
+
+inline uint8_t encodeMove(const State::NextMove& m)
+{
+    return std::visit(QuoridorFast::overloaded{
+                          [](const QuoridorFast::Advance& a) { return uint8_t(a.new_position.y * N + a.new_position.x); },
+                          [](const QuoridorFast::Put& p) { return uint8_t(128 + int(p.direction) * 64 + p.pos.y * (N - 1) + p.pos.x); }},
+        m);
+}
+
+//! 読めない値ならstd::nullopt。合法かどうかは調べない
+inline std::optional<State::NextMove> decodeMove(uint8_t code)
+{
+    static_assert(N * N <= NO_MOVE && NO_MOVE < 128);
+    if (code < N * N)
+        return QuoridorFast::Advance{{int8_t(code % N), int8_t(code / N)}};
+    if (code >= 128 && code < 128 + 2 * (N - 1) * (N - 1)) {
+        const int i = (code - 128) % ((N - 1) * (N - 1));
+        return QuoridorFast::Put{WallDirection(code >= 128 + (N - 1) * (N - 1)), {int8_t(i % (N - 1)), int8_t(i / (N - 1))}};
+    }
+    return std::nullopt;
+}
+
+inline std::array<uint8_t, STATE_SIZE> encodeState(const State& s)
+{
+    std::array<uint8_t, STATE_SIZE> data{};
+    data[0] = uint8_t(s.my_pos.x), data[1] = uint8_t(s.my_pos.y);
+    data[2] = uint8_t(s.opponent_pos.x), data[3] = uint8_t(s.opponent_pos.y);
+    data[4] = uint8_t(s.my_rem_walls), data[5] = uint8_t(s.opponent_rem_walls);
+    for (int i = 0; i < (N - 1) * (N - 1); i++) {
+        const Position p{int8_t(i % (N - 1)), int8_t(i / (N - 1))};
+        const int cell = s.hWall(p) ? 1 : s.vWall(p) ? 2 : 0;
+        data[6 + i / 4] |= uint8_t(cell << (i % 4 * 2));
+    }
+    return data;
+}
+
+//! 座標や壁の数が範囲外ならstd::nullopt
+inline std::optional<State> decodeState(const uint8_t* data)
+{
+    State s = State::initialState();
+    s.my_pos = {int8_t(data[0]), int8_t(data[1])};
+    s.opponent_pos = {int8_t(data[2]), int8_t(data[3])};
+    if (!QuoridorFast::inRange(s.my_pos) || !QuoridorFast::inRange(s.opponent_pos) || data[4] > 10 || data[5] > 10)
+        return std::nullopt;
+    s.my_rem_walls = data[4];
+    s.opponent_rem_walls = data[5];
+    for (int i = 0; i < (N - 1) * (N - 1); i++) {
+        const Position p{int8_t(i % (N - 1)), int8_t(i / (N - 1))};
+        const int cell = data[6 + i / 4] >> (i % 4 * 2) & 3;
+        if (cell == 1) {
+            s.wall_h.set(p, true);
+        } else if (cell == 2) {
+            s.wall_v.set(p, true);
+        } else if (cell == 3) {
+            return std::nullopt;
+        }
+    }
+    s.updateKey();
+    return s;
+}
+
+//! 整数をリトルエンディアンでoutに足す
+template <class T>
+void append(std::string& out, T value)
+{
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        out.push_back(char(uint8_t(uint64_t(value) >> (8 * i))));
+    }
+}
+
+//! dataからリトルエンディアンの整数を読む
+template <class T>
+T read(const uint8_t* data)
+{
+    uint64_t value = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        value |= uint64_t(data[i]) << (8 * i);
+    }
+    return T(value);
+}
+
+constexpr std::size_t ANALYSIS_SIZE = 6;  //!< 'A'の結果の1局面分のバイト数
+}  // namespace EngineProtocol
@@ -0,0 +1,111 @@
+#include "evaluator.hpp"
+#include "quoridor_fast.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*!
+ * negascout-fastの評価関数の1回あたりの時間を測る。
+ * 局面ファイルの各局面とその子の局面を評価し、std::tanhで残り壁の項を毎回計算していた以前の評価関数、
+ * 表引きのEvaluate、兄弟をまとめて評価するEvaluateのそれぞれについて、reps回のうち最短の1局面あたりの時間を出力する。
+ * 以前の評価関数と値が違う局面の数も出力する。
+ *
+ * Usage: eval-bench <局面ファイル> [reps]
+ */
+
+//! 表にする前の残り壁の項
+int tanhWallFunc(int self, int opponent)
+{
+    return int(std::tanh(opponent * 0.3) * (1.2 * self - 4.0 / (self + 0.3)) * 100000);
+}
+
+//! 表にする前の評価関数
+TScore tanhEvaluate(const QuoridorFast::State& state)
+{
+    using namespace QuoridorFast;
+    if (state.lose())
+        return -INF;
+    auto hfullwall = state.hFullWall();
+    auto vfullwall = state.vFullWall();
+    int my_dist = myDistance(state, potentialSearch(hfullwall, vfullwall, my_goal, BitBoard::oneHot(state.my_pos)));
+    int opp_dist = opponentDistance(state, potentialSearch(hfullwall, vfullwall, BitBoard::oneHot(state.opponent_pos), opponent_goal));
+    if (my_dist == -1 || opp_dist == -1)
+        return INF;
+    return (opp_dist - my_dist) * 100000 + tanhWallFunc(state.my_rem_walls, state.opponent_rem_walls) - tanhWallFunc(state.opponent_rem_walls, state.my_rem_walls);
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 3) {
+        std::cerr << "Usage: eval-bench <position-file> [reps]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int reps = argc >= 3 ? std::stoi(argv[2]) : 50;
+
+    std::vector<QuoridorFast::State> states;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        states.push_back(s);
+        s.forEachMove([&](const QuoridorFast::State::NextMove&, const QuoridorFast::State& next) { states.push_back(next); });
+    }
+    std::vector<const QuoridorFast::State*> pointers;
+    for (auto& s : states) {
+        pointers.push_back(&s);
+    }
+
+    const QuoridorFast::Evaluate eval;
+    int table_mismatches = 0;
+    for (int self = 0; self <= QuoridorFast::Evaluate::MAX_WALLS; self++) {
+        for (int opponent = 0; opponent <= QuoridorFast::Evaluate::MAX_WALLS; opponent++) {
+            if (QuoridorFast::Evaluate::wallFunc(self, opponent) != tanhWallFunc(self, opponent))
+                table_mismatches++;
+        }
+    }
+    std::vector<TScore> expected(states.size()), scalar(states.size()), batch(states.size());
+
+    // 1局面あたりの時間[ns]の、reps回のうちの最短
+    auto measure = [&](const auto& body) {
+        double best = 1e100;
+        for (int r = 0; r < reps; r++) {
+            auto start = std::chrono::steady_clock::now();
+            body();
+            best = std::min(best, double((std::chrono::steady_clock::now() - start).count()) / double(states.size()));
+        }
+        return best;
+    };
+    double tanh_ns = measure([&] {
+        for (std::size_t i = 0; i < states.size(); i++) {
+            expected[i] = tanhEvaluate(states[i]);
+        }
+    });
+    double scalar_ns = measure([&] {
+        for (std::size_t i = 0; i < states.size(); i++) {
+            scalar[i] = eval(states[i]);
+        }
+    });
+    double batch_ns = measure([&] {
+        for (std::size_t i = 0; i < states.size(); i += QuoridorFast::Evaluate::BATCH_SIZE) {
+            eval(&pointers[i], &batch[i], int(std::min<std::size_t>(QuoridorFast::Evaluate::BATCH_SIZE, states.size() - i)));
+        }
+    });
+    int mismatches = 0;
+    for (std::size_t i = 0; i < states.size(); i++) {
+        mismatches += (scalar[i] != expected[i]) + (batch[i] != expected[i]);
+    }
+
+    std::cout << "States: " << states.size() << ", wall table mismatches: " << table_mismatches << ", score mismatches: " << mismatches << '\n';
+    std::cout << std::fixed << std::setprecision(1)
+              << "tanh    " << std::setw(8) << tanh_ns << " ns/call\n"
+              << "table   " << std::setw(8) << scalar_ns << " ns/call\n"
+              << "batch   " << std::setw(8) << batch_ns << " ns/call" << std::endl;
+    return 0;
+}
@@ -0,0 +1,215 @@
+#pragma once
+#include "negaalpha.hpp"
+#include "potential_search_batch.hpp"
+#include "quoridor_fast.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <optional>
+
+namespace QuoridorFast
+{
+
+//! 自分の駒からゴールへのpotentialSearchの結果を歩数にする
+inline int myDistance(const State& state, int myps)
+{
+    return myps == -1 ? -1 : myps + state.my_pos.y;
+}
+
+//! 相手の駒からゴールへのpotentialSearchの結果を歩数にする
+inline int opponentDistance(const State& state, int oppps)
+{
+    return oppps == -1 ? -1 : oppps + N - 1 - state.opponent_pos.y;
+}
+
+/*!
+ * 評価関数の重み。Evaluatorのテンプレート引数に渡すと、コンパイル時に表になる。
+ * 残り壁の価値は wall_func(self, opponent) = tanh(opponent * wall_steepness) * (wall_linear * self - wall_scarcity / (self + wall_offset)) 歩。
+ * 相手に壁が残っているほど自分の壁も価値があり、自分の壁が少ないと大きく不利とみなす。
+ */
+struct EvalWeights {
+    TScore step = 100000;         //! 1歩の差の評価値
+    double wall_steepness = 0.3;  //! 相手の残り壁に対する自分の壁の価値の立ち上がりの速さ
+    double wall_linear = 1.2;     //! 自分の残り壁1枚あたりの価値
+    double wall_scarcity = 4.0;   //! 自分の残り壁が少ないときの不利さ
+    double wall_offset = 0.3;     //! 残り壁が0枚のときのwall_scarcityの割り算が発散しないようにする
+};
+
+inline constexpr EvalWeights default_weights{};
+
+/*!
+ * std::tanhはconstexprでないので、表を作るためのconstexprなtanh。
+ * 引数を半分にしてからexpをテイラー展開し、2乗して戻す。評価関数で使う範囲ではstd::tanhとほぼ同じ値になる。
+ */
+constexpr double constexprTanh(double x)
+{
+    double y = 2 * x;
+    int halvings = 0;
+    while (y > 0.5 || y < -0.5) {
+        y /= 2;
+        halvings++;
+    }
+    double term = 1, e = 1;
+    for (int i = 1; i < 30; i++) {
+        term *= y / i;
+        e += term;
+    }
+    while (halvings-- > 0) {
+        e *= e;
+    }
+    return (e - 1) / (e + 1);
+}
+
+/*!
+ * negascout-fastの評価関数。手番のプレイヤーから見た評価値を返す。
+ * 残り壁の項は残り壁の枚数(0..MAX_WALLS)ごとにコンパイル時に表にしておき、1回の表引きで求める。
+ * 1局面ずつ評価するほか、forEachSortedNextMovesが兄弟をまとめて評価したり、
+ * 壁を置いた子を親の局面の最短経路から差分で評価したりできる。
+ */
+template <const EvalWeights& W = default_weights>
+class Evaluator
+{
+public:
+    static constexpr int MAX_WALLS = 10;          //! 1人が持つ壁の枚数
+    static constexpr int BATCH_SIZE = BATCH_LANES;  //! 一度にまとめて評価すると効率が良い局面の数
+
+    //! 親の局面ごとの最短経路のDAG。手番は親の局面から見たもの。
+    struct ParentCache {
+        int requests = 0;  //! 壁を置く手の差分評価を頼まれた回数
+        ShortestPathDag mine;
+        ShortestPathDag opponent;
+    };
+
+    //! 残り壁の価値(歩数の差に足す分)。wall_func(self, opponent)の評価値
+    static constexpr TScore wallFunc(int self, int opponent)
+    {
+        return TScore(constexprTanh(opponent * W.wall_steepness) * (W.wall_linear * self - W.wall_scarcity / (self + W.wall_offset)) * W.step);
+    }
+
+    /*!
+     * 両者のゴールまでの歩数から評価値を計算する。歩数が-1ならゴールに届かない。
+     */
+    static TScore evaluateDistances(const State& state, int my_dist, int opp_dist)
+    {
+        if (my_dist == -1 || opp_dist == -1)
+            return INF;
+        // 読み込んだ局面の壁の数が範囲外でも表の外を読まないように抑える
+        const int self = std::clamp<int>(state.my_rem_walls, 0, MAX_WALLS);
+        const int opponent = std::clamp<int>(state.opponent_rem_walls, 0, MAX_WALLS);
+        return (opp_dist - my_dist) * W.step + wall_table[self][opponent];
+    }
+
+    static TScore evaluate(const State& state)
+    {
+        if (state.lose())
+            return -INF;
+        auto hfullwall = state.hFullWall();
+        auto vfullwall = state.vFullWall();
+        int myps = potentialSearchCounted(hfullwall, vfullwall, my_goal, BitBoard::oneHot(state.my_pos));
+        int oppps = potentialSearchCounted(hfullwall, vfullwall, BitBoard::oneHot(state.opponent_pos), opponent_goal);
+        return evaluateDistances(state, myDistance(state, myps), opponentDistance(state, oppps));
+    }
+
+    /*!
+     * n個の局面をまとめて評価し、scoresに入れる。結果はevaluateと同じ。
+     * BATCH_LANES局面ずつ、自分のゴールまでの探索と相手のゴールまでの探索をそれぞれpotentialSearchLanesでまとめて行う。
+     * 兄弟の局面の同じ側の探索は長さが揃いやすいので、同じベクトルに並べる。
+     */
+    static void evaluateBatch(const State* const* states, TScore* scores, int n)
+    {
+        for (int i = 0; i < n; i += BATCH_LANES) {
+            // [wall_h, wall_v, 自分の駒, 相手の駒][ワード][レーン]
+            uint64_t words[4][2][BATCH_LANES] = {};
+            uint64_t unused_words[BATCH_LANES];
+            for (int k = 0; k < BATCH_LANES; k++) {
+                unused_words[k] = ~uint64_t(0);
+                if (i + k >= n || states[i + k]->lose())
+                    continue;
+                const State& state = *states[i + k];
+                const BitBoard my_pos = BitBoard::oneHot(state.my_pos);
+                const BitBoard opponent_pos = BitBoard::oneHot(state.opponent_pos);
+                for (int w = 0; w < 2; w++) {
+                    words[0][w][k] = state.wall_h.data[w];
+                    words[1][w][k] = state.wall_v.data[w];
+                    words[2][w][k] = my_pos.data[w];
+                    words[3][w][k] = opponent_pos.data[w];
+                }
+                unused_words[k] = 0;
+                potential_search_count += 2;
+            }
+            const BitBoardLanes wall_h = BitBoardLanes::load(words[0][0], words[0][1]);
+            const BitBoardLanes wall_v = BitBoardLanes::load(words[1][0], words[1][1]);
+            const BitBoardLanes hfullwall = wall_h | wall_h.rshift(1);
+            const BitBoardLanes vfullwall = wall_v | wall_v.dshift(1);
+            BitBoardLanes::Vec unused;
+            std::memcpy(&unused, unused_words, sizeof(unused));
+
+            int64_t my_cost[BATCH_LANES], opponent_cost[BATCH_LANES];
+            const BitBoardLanes::Vec my_lanes = potentialSearchLanes(hfullwall, vfullwall,
+                BitBoardLanes::broadcast(my_goal), BitBoardLanes::load(words[2][0], words[2][1]), unused);
+            const BitBoardLanes::Vec opponent_lanes = potentialSearchLanes(hfullwall, vfullwall,
+                BitBoardLanes::load(words[3][0], words[3][1]), BitBoardLanes::broadcast(opponent_goal), unused);
+            std::memcpy(my_cost, &my_lanes, sizeof(my_cost));
+            std::memcpy(opponent_cost, &opponent_lanes, sizeof(opponent_cost));
+            for (int k = 0; k < BATCH_LANES && i + k < n; k++) {
+                const State& state = *states[i + k];
+                scores[i + k] = state.lose() ? -INF : evaluateDistances(state, myDistance(state, int(my_cost[k])), opponentDistance(state, int(opponent_cost[k])));
+            }
+        }
+    }
+
+    TScore operator()(const State& state) const
+    {
+        return evaluate(state);
+    }
+    void operator()(const State* const* states, TScore* scores, int n) const
+    {
+        evaluateBatch(states, scores, n);
+    }
+
+    /*!
+     * 壁を置く子の局面を、その壁が親の最短経路のDAGの辺を塞がなければ距離を探索せずに評価する。
+     * 片方でも塞ぐならstd::nulloptを返す。まとめて評価すればpotentialSearchは1局面あたりわずかなので、片方だけ探索しても得にならない。
+     * 最初の壁の手はbeta cutでそれきりになることが多いので、DAGは2手目を頼まれたときに作る。
+     */
+    std::optional<TScore> incremental(ParentCache& cache, const State& parent, const State::NextMove& m, const State& child) const
+    {
+        const Put* put = std::get_if<Put>(&m);
+        if (put == nullptr || child.lose() || ++cache.requests == 1)
+            return std::nullopt;
+        if (cache.requests == 2) {
+            const BitBoard hfullwall = parent.hFullWall();
+            const BitBoard vfullwall = parent.vFullWall();
+            cache.mine = ShortestPathDag::build(hfullwall, vfullwall, my_goal, BitBoard::oneHot(parent.my_pos));
+            cache.opponent = ShortestPathDag::build(hfullwall, vfullwall, opponent_goal, BitBoard::oneHot(parent.opponent_pos));
+        }
+        if (!cache.mine.unchangedBy(*put) || !cache.opponent.unchangedBy(*put))
+            return std::nullopt;
+        // 子の局面では手番が入れ替わっている
+        return evaluateDistances(child, cache.opponent.dist, cache.mine.dist);
+    }
+
+private:
+    using WallTable = std::array<std::array<TScore, MAX_WALLS + 1>, MAX_WALLS + 1>;
+
+    //! [自分の残り壁][相手の残り壁]に対する wallFunc(自分, 相手) - wallFunc(相手, 自分)
+    static constexpr WallTable wall_table = [] {
+        WallTable table{};
+        for (int self = 0; self <= MAX_WALLS; self++) {
+            for (int opponent = 0; opponent <= MAX_WALLS; opponent++) {
+                table[self][opponent] = wallFunc(self, opponent) - wallFunc(opponent, self);
+            }
+        }
+        return table;
+    }();
+};
+
+using Evaluate = Evaluator<>;
+
+//! 標準の重みでの評価関数
+inline TScore evaluate(const State& state)
+{
+    return Evaluate::evaluate(state);
+}
+
+}  // namespace QuoridorFast
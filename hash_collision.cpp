@@ -0,0 +1,108 @@
+#include "quoridor_fast.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+#include <vector>
+
+/*!
+ * 置換表のハッシュの衝突率を比べる。
+ * 棋譜の各局面から深さdepthまでの局面を全て列挙し、以前のXOR畳み込みハッシュとZobristハッシュで
+ * 値が重複する割合と、サイズtable_sizeの表に入れたときに同じ位置に入る割合を出力する。
+ *
+ * Usage: hash-collision <棋譜ファイル> [depth] [table_size]
+ */
+
+//! 以前のQuoridorFast::hash。盤面(keyを除く)の64bitワードをXORして32bitに畳み込む。
+uint64_t xorFoldHash(const QuoridorFast::State& s)
+{
+    constexpr int words = int(offsetof(QuoridorFast::State, key) / sizeof(uint64_t));
+    uint64_t temp = 0;
+    for (int i = 0; i < words; i++) {
+        uint64_t word;
+        std::memcpy(&word, reinterpret_cast<const char*>(&s) + i * sizeof(uint64_t), sizeof(uint64_t));
+        temp ^= word;
+    }
+    return uint32_t(temp) ^ uint32_t(temp >> 32);
+}
+
+struct Stats {
+    std::size_t distinct_hashes;
+    std::size_t used_slots;
+};
+
+template <class F>
+Stats measure(const std::vector<QuoridorFast::State>& states, std::size_t table_size, const F& hash)
+{
+    std::unordered_set<uint64_t> hashes;
+    std::vector<bool> slots(table_size);
+    std::size_t used = 0;
+    for (auto& s : states) {
+        uint64_t h = hash(s);
+        hashes.insert(h);
+        if (!slots[h % table_size]) {
+            slots[h % table_size] = true;
+            used++;
+        }
+    }
+    return {hashes.size(), used};
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: hash-collision <game-file> [depth] [table_size]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int depth = argc >= 3 ? std::stoi(argv[2]) : 2;
+    std::size_t table_size = argc >= 4 ? std::stoull(argv[3]) : (std::size_t(1) << 22);
+
+    std::vector<QuoridorFast::State> states;
+    auto expand = [&](const QuoridorFast::State& s, int d, const auto& self) -> void {
+        states.push_back(s);
+        if (d == 0 || s.lose())
+            return;
+        s.forEachMove([&](const QuoridorFast::State::NextMove&, const QuoridorFast::State& ns) {
+            self(ns, d - 1, self);
+        });
+    };
+    int games = 0;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        expand(s, depth, expand);
+        games++;
+    }
+
+    // 盤面が同じものを除く
+    auto less = [](const QuoridorFast::State& a, const QuoridorFast::State& b) {
+        return std::memcmp(&a, &b, offsetof(QuoridorFast::State, key)) < 0;
+    };
+    std::sort(states.begin(), states.end(), less);
+    states.erase(std::unique(states.begin(), states.end(),
+                     [&](const auto& a, const auto& b) { return !less(a, b) && !less(b, a); }),
+        states.end());
+    for (auto& s : states) {
+        if (s.key != s.computeKey(false) || s.flip_key != s.computeKey(true)) {
+            std::cerr << "Zobrist key mismatch:\n"
+                      << s.pretty() << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "Positions: " << games << ", depth: " << depth << ", distinct states: " << states.size() << ", table size: " << table_size << '\n';
+    auto report = [&](const char* name, const auto& hash) {
+        Stats st = measure(states, table_size, hash);
+        std::cout << name << ": hash collisions " << states.size() - st.distinct_hashes
+                  << " (" << 100.0 * double(states.size() - st.distinct_hashes) / double(states.size()) << "%)"
+                  << ", slot collisions " << states.size() - st.used_slots
+                  << " (" << 100.0 * double(states.size() - st.used_slots) / double(states.size()) << "%)" << '\n';
+    };
+    report("xor-fold", xorFoldHash);
+    report("zobrist ", [](const QuoridorFast::State& s) { return QuoridorFast::State::hash(s); });
+    return 0;
+}
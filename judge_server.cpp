@@ -0,0 +1,150 @@
+#include "quoridor.hpp"
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+namespace asio = boost::asio;
+using asio::ip::tcp;
+
+/*!
+ * tcp-pipeやtcp-bridgeを試すための、対局サーバーの代わり。
+ * 接続してきた順に2つずつ組にして、1つ目を先手(PLAYER 1)、2つ目を後手(PLAYER 2)として対局させる。対局は組ごとにスレッドで並列に行う。
+ * 接続するとまず後手かどうか(0か1)を送り、その後は手番の側にだけ、先手から見た局面をテキストで送る。
+ * 手は先手から見た座標で、駒を動かす手は"x y"、壁を置く手は"x y H"か"x y V"の形で受け取る。
+ * 反則の手を指すか接続が切れたら負け。max-pliesで決着がつかなければ引き分け。対局が終わったら両方の接続を閉じる。
+ *
+ * Usage: judge-server [--port P] [--games N] [--max-plies N]
+ */
+
+namespace
+{
+using Quoridor::N;
+
+/*!
+ * 受け取った手を、手番の側から見た手にする。読めなければstd::nullopt。
+ * @param flipped 後手の手ならtrue。後手から見た座標は先手から見た座標を180度回したもの
+ */
+std::optional<Quoridor::State::NextMove> parseMove(const std::string& text, bool flipped)
+{
+    std::istringstream in(text);
+    std::vector<std::string> tokens;
+    for (std::string token; in >> token;) {
+        tokens.push_back(token);
+    }
+    try {
+        if (tokens.size() == 2) {
+            int x = std::stoi(tokens[0]), y = std::stoi(tokens[1]);
+            if (flipped)
+                x = N - 1 - x, y = N - 1 - y;
+            return Quoridor::Advance{{x, y}};
+        }
+        if (tokens.size() == 3 && (tokens[2] == "H" || tokens[2] == "V")) {
+            int x = std::stoi(tokens[0]), y = std::stoi(tokens[1]);
+            if (flipped)
+                x = N - 2 - x, y = N - 2 - y;
+            return Quoridor::Put{tokens[2] == "H" ? Quoridor::WallDirection::Horizontal : Quoridor::WallDirection::Vertical, {x, y}};
+        }
+    } catch (std::exception&) {
+    }
+    return std::nullopt;
+}
+
+void send(tcp::socket& socket, const std::string& text)
+{
+    boost::system::error_code ec;
+    asio::write(socket, asio::buffer(text), ec);
+}
+
+/*!
+ * 1局指して、勝った側(0が先手、1が後手)を返す。引き分けならstd::nullopt。
+ * 手が来るまで待つ。1回の受信で届いたものを1手とする。
+ */
+std::optional<int> playGame(std::array<tcp::socket, 2>& players, int max_plies, int game, std::mutex& log_mutex)
+{
+    auto log = [&](const std::string& text) {
+        std::lock_guard lock{log_mutex};
+        std::cout << "game " << game << ": " << text << std::endl;
+    };
+    send(players[0], "0\n");
+    send(players[1], "1\n");
+    Quoridor::State s = Quoridor::State::initialState();  // 先手から見た局面
+    for (int ply = 0; ply < max_plies; ply++) {
+        const int turn = ply % 2;
+        std::ostringstream state;
+        state << s;
+        send(players[turn], state.str());
+
+        std::array<char, 256> data;
+        boost::system::error_code ec;
+        const std::size_t size = players[turn].read_some(asio::buffer(data), ec);
+        const std::string text(data.data(), ec ? 0 : size);
+        const auto m = parseMove(text, turn == 1);
+        // 後手の手は後手から見た局面に指し、結果は先手から見た局面になる
+        const auto next = m ? (turn == 0 ? s : s.flipPlayers()).move(*m) : std::nullopt;
+        if (!next) {
+            log("player " + std::to_string(turn + 1) + (ec ? " disconnected: " + ec.message() : " sent an invalid move: " + text) + " at ply " + std::to_string(ply));
+            return 1 - turn;
+        }
+        s = turn == 0 ? next->flipPlayers() : *next;
+        if (next->lose()) {
+            log("player " + std::to_string(turn + 1) + " wins at ply " + std::to_string(ply + 1));
+            return turn;
+        }
+    }
+    log("draw");
+    return std::nullopt;
+}
+}  // namespace
+
+int main(int argc, const char** argv)
+{
+    unsigned short port = 8080;
+    int games = 1;
+    int max_plies = 200;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = static_cast<unsigned short>(std::stoi(argv[++i]));
+        } else if (arg == "--games" && i + 1 < argc) {
+            games = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--max-plies" && i + 1 < argc) {
+            max_plies = std::max(1, std::stoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: judge-server [--port P] [--games N] [--max-plies N]" << std::endl;
+            return 1;
+        }
+    }
+
+    asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), port));
+    std::cerr << "Listening on port " << port << " for " << games << " games" << std::endl;
+
+    std::mutex mutex;
+    std::atomic<int> wins[2] = {}, draws{0};
+    std::vector<std::thread> threads;
+    for (int g = 0; g < games; g++) {
+        auto players = std::make_shared<std::array<tcp::socket, 2>>(std::array<tcp::socket, 2>{acceptor.accept(), acceptor.accept()});
+        for (auto& p : *players) {
+            p.set_option(tcp::no_delay(true));
+        }
+        threads.emplace_back([&, players, g] {
+            const auto winner = playGame(*players, max_plies, g, mutex);
+            if (winner) {
+                wins[*winner]++;
+            } else {
+                draws++;
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    std::cout << "Games: " << games << ", player 1 wins " << wins[0] << ", player 2 wins " << wins[1] << ", draws " << draws << std::endl;
+    return 0;
+}
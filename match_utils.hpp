@@ -0,0 +1,59 @@
+#pragma once
+#include "quoridor_fast.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+/*!
+ * tournamentとsprtで共通の、対局の組み立てと結果の集計。
+ * どちらも同じ開始局面の作り方とEloの換算を使うよう、ここにまとめる。
+ */
+namespace Match
+{
+enum class Outcome {
+    FirstWins,
+    SecondWins,
+    Draw,
+};
+
+/*!
+ * 初期局面から、seedで決まるランダムな合法手をplies手進めた局面を返す。途中で勝負がつく手は選ばない。
+ */
+inline QuoridorFast::State randomOpening(uint64_t seed, int plies)
+{
+    std::mt19937_64 rng(seed);
+    QuoridorFast::State s = QuoridorFast::State::initialState();
+    for (int ply = 0; ply < plies; ply++) {
+        std::vector<QuoridorFast::State> children;
+        s.forEachMove([&](const QuoridorFast::State::NextMove&, const QuoridorFast::State& next) {
+            if (!next.lose())
+                children.push_back(next);
+        });
+        if (children.empty())
+            break;
+        s = children[std::uniform_int_distribution<std::size_t>(0, children.size() - 1)(rng)];
+    }
+    return s;
+}
+
+//! 全体のseedから、pair組目(先手を入れ替えた2局)の開始局面のseedを作る
+inline uint64_t openingSeed(uint64_t seed, uint64_t pair)
+{
+    return seed * 0x9e3779b97f4a7c15ull + pair;
+}
+
+//! Eloの差eloに対応する期待得点
+inline double scoreFromElo(double elo)
+{
+    return 1.0 / (1.0 + std::pow(10.0, -elo / 400.0));
+}
+
+//! 期待得点scoreに対応するEloの差
+inline double eloFromScore(double score)
+{
+    score = std::clamp(score, 1e-6, 1 - 1e-6);
+    return -400.0 * std::log10(1.0 / score - 1.0);
+}
+}  // namespace Match
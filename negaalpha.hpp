@@ -1,12 +1,16 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cmath>
 #include <cstring>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <random>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifndef NORANDOM
@@ -23,83 +27,499 @@ using Move = typename TState::NextMove;
 template <class TState>
 using NextState = typename TState::NextState;
 
-struct Abort {
+/*!
+ * 探索の打ち切りの合図。探索に使うstop()として渡せる。
+ * 探索しているスレッドとは別のスレッド(ponderやヘルパースレッドを止めるスレッド)から立ててよい。
+ */
+class StopFlag
+{
+public:
+    void request()
+    {
+        flag.store(true, std::memory_order_release);
+    }
+    void reset()
+    {
+        flag.store(false, std::memory_order_relaxed);
+    }
+    bool operator()() const
+    {
+        return flag.load(std::memory_order_acquire);
+    }
+
+private:
+    std::atomic<bool> flag{false};
+};
+
+/*!
+ * TStateが std::optional<TScore> cheapMoveScore(const NextMove&) const を持っているか。
+ * 持っている場合、値を返した手(Quoridorでは壁)は評価関数を呼ぶのを後回しにし、その見積もりで並べる。
+ */
+template <class TState, class = void>
+struct HasCheapMoveScore : std::false_type {
+};
+
+template <class TState>
+struct HasCheapMoveScore<TState, std::void_t<decltype(std::declval<const TState&>().cheapMoveScore(std::declval<const Move<TState>&>()))>>
+    : std::true_type {
+};
+
+/*!
+ * TStateが手を[0, MOVE_KEY_SIZE)の整数に対応させる static int moveKey(const NextMove&) を持っているか。
+ * 持っている場合、history heuristicの表をその大きさで持つ。
+ */
+template <class TState, class = void>
+struct HasMoveKey : std::false_type {
+    static constexpr int size = 0;
+};
+
+template <class TState>
+struct HasMoveKey<TState, std::void_t<decltype(TState::MOVE_KEY_SIZE), decltype(TState::moveKey(std::declval<const Move<TState>&>()))>>
+    : std::true_type {
+    static constexpr int size = TState::MOVE_KEY_SIZE;
+};
+
+/*!
+ * 評価関数FEvalが、局面をまとめて評価する void operator()(const NextState* const* states, TScore* scores, int n) const と
+ * 一度にまとめると効率の良い数 BATCH_SIZE を持っているか。
+ */
+template <class FEval, class TState, class = void>
+struct HasBatchEval : std::false_type {
+    static constexpr int size = 1;
+};
+
+template <class FEval, class TState>
+struct HasBatchEval<FEval, TState, std::void_t<decltype(FEval::BATCH_SIZE), decltype(std::declval<const FEval&>()(std::declval<const NextState<TState>* const*>(), std::declval<TScore*>(), 0))>>
+    : std::true_type {
+    static constexpr int size = FEval::BATCH_SIZE;
+};
+
+/*!
+ * 評価関数FEvalが、親の局面から子の評価値を差分で求める
+ * std::optional<TScore> incremental(ParentCache& cache, const TState& parent, const Move& m, const NextState& child) const を持っているか。
+ * cacheは親の局面ごとに値初期化して渡す。std::nulloptなら普通に評価する。
+ */
+template <class FEval, class TState, class = void>
+struct HasIncrementalEval : std::false_type {
+    struct Cache {
+    };
 };
 
-int search_depth = -1;  //! 現在の探索深度
-int table_depth = -1;   //! 最良手優先探索用のテーブルをどこまで見るか(反復深化を使う場合、前回の探索の深度を入れる。)
-int16_t turn_id = 0;
+template <class FEval, class TState>
+struct HasIncrementalEval<FEval, TState, std::void_t<typename FEval::ParentCache, decltype(std::declval<const FEval&>().incremental(std::declval<typename FEval::ParentCache&>(), std::declval<const TState&>(), std::declval<const Move<TState>&>(), std::declval<const NextState<TState>&>()))>>
+    : std::true_type {
+    using Cache = typename FEval::ParentCache;
+};
+
+//! 置換表に保存されたスコアの種類
+enum class Bound : int8_t {
+    None = 0,  //!< 空のエントリ
+    Exact,     //!< 正確な値
+    Lower,     //!< 下界(beta cutした)
+    Upper      //!< 上界(alphaを超えなかった)
+};
+
+/*!
+ * 置換表。64バイト(キャッシュライン1本)のバケットに16バイトのスロットを4つずつ入れる。
+ * 局面そのものは持たず、64bitのハッシュ値で照合する。
+ * 複数のスレッドからロックなしで読み書きする。スロットにはkey ^ entryを入れておき、
+ * 書き込みが混ざって壊れたスロットは照合に失敗するようにする。
+ * 表の領域は最初に使うとき(resizeを呼んだらそのとき)に確保する。使わないまま別の表を使うプログラムでも、大きな表を確保せずに済む。
+ */
 template <class TState>
 struct HashTable {
-    struct HashEntry {  // 48 bytes
-        TState state;
-        int16_t search_depth;
-        int16_t turn_id;
-        TScore score;
+    struct HashEntry {  // 8 bytes
+        int32_t score;
+        int16_t move;       //! 最善手のインデックス(forEachMoveの列挙順)。なければ-1
+        int8_t depth;       //! 残り探索深さ
+        uint8_t age_bound;  //! 上位6bitが世代、下位2bitがBound
+
+        Bound bound() const { return Bound(age_bound & 3); }
+        int age() const { return age_bound >> 2; }
     };
-    static constexpr uint32_t HASH_N = 20000003;
-    std::array<HashEntry, HASH_N> data;
-    static uint32_t index(const TState& state)
+    static_assert(sizeof(HashEntry) == sizeof(uint64_t));
+
+    struct Slot {  // 16 bytes
+        uint64_t check;  //! key ^ data
+        uint64_t data;   //! HashEntryのビット列
+    };
+    static constexpr int BUCKET_SIZE = 4;
+    struct alignas(64) Bucket {
+        std::array<Slot, BUCKET_SIZE> slots;
+    };
+    static_assert(sizeof(Bucket) == 64);
+
+    static constexpr std::size_t DEFAULT_MB = 64;
+    std::vector<Bucket> buckets;
+    int16_t turn_id = 0;  //! エントリの世代。手番ごとにnewTurn()で増やす。
+
+    explicit HashTable(std::size_t megabytes = DEFAULT_MB) : megabytes(megabytes) {}
+    HashTable(const HashTable&) = delete;
+    HashTable& operator=(const HashTable&) = delete;
+
+    //! 表の大きさを変えて確保する。中身は消える。
+    void resize(std::size_t megabytes)
     {
-        uint32_t hash = TState::hash(state);
-        return hash % HASH_N;
+        std::lock_guard lock{allocation_mutex};
+        this->megabytes = megabytes;
+        buckets.assign(std::max<std::size_t>(1, (megabytes << 20) / sizeof(Bucket)), Bucket{});
+        allocated.store(true, std::memory_order_release);
     }
-    void push(const TState& state, TScore score, int16_t search_depth)
+
+    void clear()
     {
-        HashEntry& entry = data[index(state)];
-        if (entry.turn_id == ::turn_id && entry.search_depth == search_depth) {
-            if (entry.score < score) {
-                entry.state = state;
-                entry.score = score;
-            }
+        if (allocated.load(std::memory_order_acquire))
+            std::fill(buckets.begin(), buckets.end(), Bucket{});
+    }
 
-        } else {
-            entry.state = state;
-            entry.score = score;
-            entry.search_depth = search_depth;
-            entry.turn_id = ::turn_id;
-        }
+    void newTurn()
+    {
+        turn_id++;
+    }
+
+    Bucket& bucket(uint64_t key)
+    {
+        if (!allocated.load(std::memory_order_acquire))
+            allocate();
+        return buckets[std::size_t((unsigned __int128)key * buckets.size() >> 64)];
+    }
+
+    int currentAge() const
+    {
+        return turn_id & 63;
+    }
+
+    static uint64_t pack(const HashEntry& entry)
+    {
+        uint64_t data;
+        std::memcpy(&data, &entry, sizeof(data));
+        return data;
+    }
+    static HashEntry unpack(uint64_t data)
+    {
+        HashEntry entry;
+        std::memcpy(&entry, &data, sizeof(data));
+        return entry;
+    }
+
+    struct LoadedSlot {
+        uint64_t key;
+        HashEntry entry;
+    };
+    static LoadedSlot load(const Slot& slot)
+    {
+        uint64_t check = __atomic_load_n(&slot.check, __ATOMIC_RELAXED);
+        uint64_t data = __atomic_load_n(&slot.data, __ATOMIC_RELAXED);
+        return {check ^ data, unpack(data)};
     }
-    std::optional<TScore> get(const TState& state, int16_t search_depth)
+    static void save(Slot& slot, uint64_t key, const HashEntry& entry)
     {
-        HashEntry& entry = data[index(state)];
-        if (entry.turn_id == ::turn_id && entry.search_depth == search_depth) {
-            return entry.score;
+        uint64_t data = pack(entry);
+        __atomic_store_n(&slot.check, key ^ data, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot.data, data, __ATOMIC_RELAXED);
+    }
+
+    /*!
+     * 状態に対応するエントリを探す。
+     */
+    std::optional<HashEntry> probe(const TState& state)
+    {
+        uint64_t key = TState::hash(state);
+        for (const auto& slot : bucket(key).slots) {
+            auto [slot_key, entry] = load(slot);
+            if (slot_key == key && entry.bound() != Bound::None)
+                return entry;
         }
         return std::nullopt;
     }
-};
 
-template <class TState>
-struct HashBuf {
-    HashTable<TState> hash_buffer[2];
-    HashTable<TState>* read_buf = &hash_buffer[0];
-    HashTable<TState>* write_buf = &hash_buffer[1];
-    HashTable<TState>& readBuf() { return *read_buf; }
-    HashTable<TState>& writeBuf() { return *write_buf; }
+    /*!
+     * 探索結果を保存する。
+     * 同じ局面のエントリがあればそれを上書きし、なければバケットの中で古くて浅いエントリを追い出す。
+     */
+    void store(const TState& state, TScore score, int depth, Bound bound, int move)
+    {
+        uint64_t key = TState::hash(state);
+        const int age = currentAge();
+        auto worth = [&](const HashEntry& e) {
+            return e.bound() == Bound::None ? -1000 : e.depth - 8 * ((age - e.age()) & 63);
+        };
 
-    void swap()
+        Bucket& b = bucket(key);
+        Slot* victim = nullptr;
+        int victim_worth = 0;
+        for (auto& slot : b.slots) {
+            auto [slot_key, entry] = load(slot);
+            if (slot_key == key && entry.bound() != Bound::None) {
+                if (move == -1)
+                    move = entry.move;
+                // 同じ世代でより深く探索した結果は残す
+                if (entry.age() == age && entry.depth > depth) {
+                    entry.move = int16_t(move);
+                    save(slot, key, entry);
+                    return;
+                }
+                victim = &slot;
+                break;
+            }
+            if (victim == nullptr || worth(entry) < victim_worth) {
+                victim = &slot;
+                victim_worth = worth(entry);
+            }
+        }
+        save(*victim, key, HashEntry{score, int16_t(move), int8_t(depth), uint8_t(age << 2 | int(bound))});
+    }
+
+private:
+    //! まだ確保していなければmegabytesの大きさで確保する。探索中の複数のスレッドから同時に呼ばれてもよい
+    void allocate()
     {
-        std::swap(read_buf, write_buf);
+        std::lock_guard lock{allocation_mutex};
+        if (allocated.load(std::memory_order_relaxed))
+            return;
+        buckets.assign(std::max<std::size_t>(1, (megabytes << 20) / sizeof(Bucket)), Bucket{});
+        allocated.store(true, std::memory_order_release);
     }
+
+    std::size_t megabytes;               //! 確保する大きさ(MB)
+    std::atomic<bool> allocated{false};  //! bucketsを確保したか
+    std::mutex allocation_mutex;
 };
 
+template <class TState>
+HashTable<TState> hash_table;  //! 置換表。反復深化の各探索や手番、スレッドをまたいで共有する。SearchContext::tableの既定値
+
+/*!
+ * 置換表に残っているstateの最善手と、それを指した次の状態を返す。置換表になければstd::nullopt。
+ * 探索し終えた後に、最善手の先の局面の最善手(相手の応手の予想)を調べるのに使う。
+ */
+template <class TState>
+std::optional<std::pair<Move<TState>, NextState<TState>>> hashMove(const TState& state, HashTable<TState>& table = hash_table<TState>)
+{
+    const auto entry = table.probe(state);
+    if (!entry || entry->move < 0)
+        return std::nullopt;
+    std::optional<std::pair<Move<TState>, NextState<TState>>> ret;
+    int index = 0;
+    state.forEachMove([&](const Move<TState>& move, const NextState<TState>& next_state) {
+        if (index++ == entry->move)
+            ret.emplace(move, next_state);
+    });
+    return ret;
+}
 
 constexpr int MAX_DEPTH = 40;
-int best_path_table[MAX_DEPTH][MAX_DEPTH];  //! 最良手優先探索用のテーブル。最終的にはbest_path_table[0][...]に最良手のインデックスが集まってくる。
 
-template <class TState, class FEval, class F>
-void forEachSortedNextMoves(const TState& state, const FEval& eval, const F& func, int best_path_id)
-{
+/*!
+ * 1手分の合法手のリスト。探索中にヒープ確保しないよう、SearchContextが深さごとに持って使い回す。
+ */
+template <class TState>
+struct MoveList {
+    static constexpr int INITIAL_CAPACITY = 256;  //! Quoridorの合法手は高々 5 + 2 * 72 手
 
     struct Entry {
-        TScore score;
+        TScore score;   //! 評価値。deferredなら安い見積もり
         Move<TState> move;
         NextState<TState> state;
+        bool deferred;    //! 評価関数を呼ぶのを後回しにする手
+        int32_t history;  //! history heuristicの値
     };
+    std::vector<Entry> entries;
+    std::vector<Entry*> order;  //! entriesを並べ替えたもの
+
+    MoveList()
+    {
+        entries.reserve(INITIAL_CAPACITY);
+        order.reserve(INITIAL_CAPACITY);
+    }
+};
+
+/*!
+ * Late move reductionの設定。
+ * 並べ替えで後ろの方に来た静かな手(後回しにした手のうちkiller以外)を浅く探索し、alphaを超えたときだけ元の深さで探索し直す。
+ * 強くなるかはまだ対局で確かめていないので、既定では使わない。
+ */
+struct LateMoveReduction {
+    static constexpr int MAX_MOVES = 64;
+
+    bool enabled = false;
+    int min_moves = 4;  //! 何手目(0始まり)から減らすか
+    int min_depth = 3;  //! 残り深さがこれ以上のノードでだけ減らす
+    std::array<std::array<int8_t, MAX_MOVES>, MAX_DEPTH> table{};  //! [残り深さ][何手目か] -> 減らす深さ
+
+    LateMoveReduction()
+    {
+        setTable(0.5, 2.0);
+    }
+
+    //! table[d][m] = base + log(d) * log(m) / divisor にする。子の残り深さが1未満にならないように抑える。
+    void setTable(double base, double divisor)
+    {
+        for (int d = 1; d < MAX_DEPTH; d++) {
+            for (int m = 1; m < MAX_MOVES; m++) {
+                table[d][m] = int8_t(std::clamp(int(base + std::log(d) * std::log(m) / divisor), 0, std::max(0, d - 2)));
+            }
+        }
+    }
+
+    int reduction(int remaining_depth, int move_count) const
+    {
+        if (!enabled || remaining_depth < min_depth || move_count < min_moves)
+            return 0;
+        return table[std::min(remaining_depth, MAX_DEPTH - 1)][std::min(move_count, MAX_MOVES - 1)];
+    }
+
+    struct Stats {
+        uint64_t reduced = 0;      //! 減らして探索した手の数
+        uint64_t researched = 0;   //! 減らした探索でalphaを超え、探索し直した手の数
+
+        friend std::ostream& operator<<(std::ostream& os, const Stats& st)
+        {
+            return os << "LMR: " << st.reduced << " reduced, " << st.researched << " re-searched ("
+                      << (st.reduced == 0 ? 0.0 : 100.0 * double(st.researched) / double(st.reduced)) << "%)";
+        }
+    };
+};
+
+/*!
+ * 探索の様子を数えるカウンタ。NOVERBOSEのリリースビルドでも数える。
+ * 置換表の効き具合、beta cutが最初の手で起きたか(手の並べ替えの良さ)、NegaScoutの探索し直しの回数を見る。
+ */
+struct SearchStats {
+    uint64_t tt_probes = 0;        //! 置換表を引いた回数
+    uint64_t tt_hits = 0;          //! 置換表に局面があった回数
+    uint64_t tt_cuts = 0;          //! 置換表の値だけで探索を打ち切った回数
+    uint64_t first_move_cuts = 0;  //! 最初に探索した手でbeta cutした回数
+    uint64_t later_cuts = 0;       //! 2手目以降の手でbeta cutした回数
+    uint64_t researches = 0;       //! null windowの探索でalphaを超え、窓を広げて探索し直した回数
+};
+
+/*!
+ * 探索スレッドごとの状態。
+ */
+template <class TState>
+struct SearchContext {
+    int search_depth = -1;  //! 現在の探索深度
+    int table_depth = -1;   //! 最良手優先探索用のテーブルをどこまで見るか(反復深化を使う場合、前回の探索の深度を入れる。)
+    int best_path_table[MAX_DEPTH][MAX_DEPTH];  //! 最良手優先探索用のテーブル。最終的にはbest_path_table[0][...]に最良手のインデックスが集まってくる。
+    int thread_id = 0;  //! 0がメインスレッド。デバッグ出力はメインスレッドだけが行う。
+    bool aborted = false;  //! stop()で探索を打ち切っている途中。立っていたら、探索の値を使わずに呼び出し元へ戻る
+    HashTable<TState>* table = &hash_table<TState>;  //! 使う置換表。同じプロセスで別々の対局を探索するときは別の表を指す
+    std::vector<int> root_excluded;  //! 根で探索しない手のインデックス(forEachMoveの列挙順)。multipvで2番目以降の手を探すのに使う
+    uint64_t nodes = 0;  //! 探索したノード数
+    uint64_t evals = 0;  //! 子の評価関数を呼んだ回数
+    uint64_t incremental_evals = 0;  //! evalsのうち、親の局面から差分で求めた回数
+    std::array<MoveList<TState>, MAX_DEPTH> move_lists;  //! 深さごとの合法手リスト
+    static constexpr int KILLER_SLOTS = 2;
+    static constexpr int32_t HISTORY_MAX = 1 << 24;
+    //! 深さごとに、最近beta cutを起こした後回しの手。新しいものが先頭。
+    std::array<std::array<std::optional<Move<TState>>, KILLER_SLOTS>, MAX_DEPTH> killers;
+    //! 手(TState::moveKey)ごとに、beta cutを起こした回数を残り深さの2乗で重み付けして足したもの
+    std::array<int32_t, HasMoveKey<TState>::size> history{};
+
+    //! 反復深化で前回までの評価値を中心にとる探索窓の半分の幅。評価関数の単位に合わせる。0なら窓を使わない。
+    TScore aspiration_window = 0;
+    std::array<std::optional<TScore>, MAX_DEPTH + 1> iteration_scores;  //! 今の手番の反復深化で、深さごとの評価値
 
-    std::vector<Entry> next_entries;
-    next_entries.reserve(1024);
+    struct AspirationStats {
+        uint64_t searches = 0;   //! 探索窓を使った反復の数
+        uint64_t fail_low = 0;   //! 評価値が窓より下で再探索した回数
+        uint64_t fail_high = 0;  //! 評価値が窓より上で再探索した回数
+
+        friend std::ostream& operator<<(std::ostream& os, const AspirationStats& st)
+        {
+            uint64_t researches = st.fail_low + st.fail_high;
+            return os << "Aspiration: " << st.searches << " searches, " << st.fail_low << " fail-low, " << st.fail_high << " fail-high ("
+                      << (st.searches == 0 ? 0.0 : 100.0 * double(researches) / double(st.searches)) << "% re-searched)";
+        }
+    } aspiration_stats;
+
+    LateMoveReduction lmr;
+    LateMoveReduction::Stats lmr_stats;
+    SearchStats search_stats;
+};
+
+/*!
+ * SearchContextの累計のカウンタを写したもの。反復の前後の差をとって、反復ごとの統計にする。
+ */
+struct SearchCounters {
+    uint64_t nodes = 0;
+    uint64_t evals = 0;
+    uint64_t incremental_evals = 0;
+    SearchStats search;
+    uint64_t aspiration_fail_low = 0;
+    uint64_t aspiration_fail_high = 0;
+    uint64_t lmr_reduced = 0;
+    uint64_t lmr_researched = 0;
+
+    template <class TState>
+    static SearchCounters of(const SearchContext<TState>& ctx)
+    {
+        return {ctx.nodes, ctx.evals, ctx.incremental_evals, ctx.search_stats,
+            ctx.aspiration_stats.fail_low, ctx.aspiration_stats.fail_high, ctx.lmr_stats.reduced, ctx.lmr_stats.researched};
+    }
+
+    //! aとbの同じカウンタの組ごとにf(名前, aの値, bの値)を呼ぶ
+    template <class A, class B, class F>
+    static void zip(A& a, B& b, const F& f)
+    {
+        f("nodes", a.nodes, b.nodes);
+        f("evals", a.evals, b.evals);
+        f("incremental_evals", a.incremental_evals, b.incremental_evals);
+        f("tt_probes", a.search.tt_probes, b.search.tt_probes);
+        f("tt_hits", a.search.tt_hits, b.search.tt_hits);
+        f("tt_cuts", a.search.tt_cuts, b.search.tt_cuts);
+        f("first_move_cuts", a.search.first_move_cuts, b.search.first_move_cuts);
+        f("later_cuts", a.search.later_cuts, b.search.later_cuts);
+        f("researches", a.search.researches, b.search.researches);
+        f("aspiration_fail_low", a.aspiration_fail_low, b.aspiration_fail_low);
+        f("aspiration_fail_high", a.aspiration_fail_high, b.aspiration_fail_high);
+        f("lmr_reduced", a.lmr_reduced, b.lmr_reduced);
+        f("lmr_researched", a.lmr_researched, b.lmr_researched);
+    }
+
+    SearchCounters& operator+=(const SearchCounters& other)
+    {
+        zip(*this, other, [](const char*, uint64_t& x, uint64_t y) { x += y; });
+        return *this;
+    }
+    SearchCounters operator-(const SearchCounters& other) const
+    {
+        SearchCounters ret = *this;
+        zip(ret, other, [](const char*, uint64_t& x, uint64_t y) { x -= y; });
+        return ret;
+    }
+
+    //! JSONのオブジェクトのメンバーとして、"名前":値をカンマ区切りで出力する。前後の括弧とカンマは付けない。
+    void writeJsonMembers(std::ostream& os) const
+    {
+        bool first = true;
+        zip(*this, *this, [&](const char* name, uint64_t value, uint64_t) {
+            os << (first ? "" : ",") << '"' << name << "\":" << value;
+            first = false;
+        });
+    }
+};
+
+/*!
+ * 次の手を良さそうな順に列挙し、funcを呼ぶ。順番は以下の通り。
+ * 1. best_path_id(前回の反復の最善手)、hash_move_id(置換表の最善手)
+ * 2. 後回しにしない手(Quoridorでは駒の移動)を評価値の良い順に
+ * 3. 同じ深さでbeta cutを起こした手(killer)を新しい順に
+ * 4. 残りの後回しにした手をhistoryの大きい順に。historyが同じなら安い見積もりの良い順に。評価関数は手番が来たときに呼ぶ。
+ * 2.の評価値が同じ手もhistoryの大きい順に並べる。
+ * evalがまとめて評価できる(HasBatchEval)なら、2.はまとめて評価し、4.は2手目からBATCH_SIZE手ずつ先読みして評価する。
+ * evalが差分で評価できる(HasIncrementalEval)なら、先にそれを試し、できなかった手だけを普通に評価する。
+ * funcがfalseを返したら列挙を打ち切る。途中で打ち切れば、残りの手の評価関数は呼ばない。
+ * 手のリストにはctx.move_lists[depth]を使う。
+ */
+template <class TState, class FEval, class F>
+void forEachSortedNextMoves(SearchContext<TState>& ctx, int depth, const TState& state, const FEval& eval, const F& func, int best_path_id, int hash_move_id = -1)
+{
+    using Entry = typename MoveList<TState>::Entry;
+    auto& next_entries = ctx.move_lists[depth].entries;
+    auto& next_entry_ptrs = ctx.move_lists[depth].order;
+    next_entries.clear();
     state.forEachMove([&](const Move<TState>& move, const NextState<TState>& next_state) {
 
 #ifndef NDEBUG
@@ -116,33 +536,172 @@ void forEachSortedNextMoves(const TState& state, const FEval& eval, const F& fun
             std::abort();
         }
 #endif
-        next_entries.push_back(Entry{eval(next_state), move, next_state});
+        Entry entry{0, move, next_state, false, 0};
+        if constexpr (HasMoveKey<TState>::value) {
+            entry.history = ctx.history[TState::moveKey(move)];
+        }
+        if constexpr (HasCheapMoveScore<TState>::value) {
+            if (auto cheap = state.cheapMoveScore(move)) {
+                entry.score = *cheap;
+                entry.deferred = true;
+            }
+        }
+        next_entries.push_back(entry);
     });
-    std::vector<Entry*> next_entry_ptrs(next_entries.size());
-    for (int i = 0; i < int(next_entries.size()); i++) {
-        next_entry_ptrs[i] = &next_entries[i];
-    }
-    if (best_path_id != -1 && next_entry_ptrs.size() > /*best_path_id*/ 0) {
-        next_entry_ptrs.at(best_path_id) = next_entry_ptrs.back();
-        next_entry_ptrs.resize(next_entry_ptrs.size() - 1);
 
+    [[maybe_unused]] typename HasIncrementalEval<FEval, TState>::Cache parent_cache{};
+    auto evaluateIncremental = [&](Entry& entry) {
+        if constexpr (HasIncrementalEval<FEval, TState>::value) {
+            if (auto score = eval.incremental(parent_cache, state, entry.move, entry.state)) {
+                entry.score = *score;
+                ctx.evals++;
+                ctx.incremental_evals++;
+                return true;
+            }
+        }
+        return false;
+    };
+    auto evaluate = [&](Entry& entry) {
+        if (evaluateIncremental(entry))
+            return;
+        entry.score = eval(entry.state);
+        ctx.evals++;
+    };
+    // [first, last)の手をまとめて評価する
+    auto evaluateRange = [&](Entry* const* first, Entry* const* last) {
+        if constexpr (HasBatchEval<FEval, TState>::value) {
+            constexpr int BATCH_SIZE = HasBatchEval<FEval, TState>::size;
+            Entry* batch_entries[BATCH_SIZE];
+            const NextState<TState>* batch_states[BATCH_SIZE];
+            TScore batch_scores[BATCH_SIZE];
+            int m = 0;
+            auto flush = [&] {
+                eval(batch_states, batch_scores, m);
+                for (int i = 0; i < m; i++) {
+                    batch_entries[i]->score = batch_scores[i];
+                }
+                ctx.evals += m;
+                m = 0;
+            };
+            for (; first != last; ++first) {
+                if (evaluateIncremental(**first))
+                    continue;
+                batch_entries[m] = *first;
+                batch_states[m] = &(*first)->state;
+                if (++m == BATCH_SIZE)
+                    flush();
+            }
+            if (m > 0)
+                flush();
+        } else {
+            for (; first != last; ++first) {
+                evaluate(**first);
+            }
+        }
+    };
+    auto call = [&](Entry& entry, bool is_best) {
+        return func(entry.score, entry.move, entry.state, int(&entry - next_entries.data()), is_best);
+    };
 
-        auto [score, next_move, next_state] = next_entries[best_path_id];
-        bool cont = func(score, next_move, next_state, best_path_id, true);
-        if (!cont)
+    const int n = int(next_entries.size());
+    if (best_path_id >= n)
+        best_path_id = -1;
+    if (hash_move_id >= n || hash_move_id == best_path_id)
+        hash_move_id = -1;
+    for (int id : {best_path_id, hash_move_id}) {
+        if (id == -1)
+            continue;
+        evaluate(next_entries[id]);
+        if (!call(next_entries[id], id == best_path_id))
             return;
     }
+    auto remaining = [&](const Entry& entry) {
+        int id = int(&entry - next_entries.data());
+        return id != best_path_id && id != hash_move_id;
+    };
+    auto by_score = [](const Entry* a, const Entry* b) {
+        return a->score != b->score ? a->score < b->score : a->history > b->history;
+    };
+    auto by_history = [](const Entry* a, const Entry* b) {
+        return a->history != b->history ? a->history > b->history : a->score < b->score;
+    };
 
+    next_entry_ptrs.clear();
+    for (auto& entry : next_entries) {
+        if (!entry.deferred && remaining(entry)) {
+            next_entry_ptrs.push_back(&entry);
+        }
+    }
+    evaluateRange(next_entry_ptrs.data(), next_entry_ptrs.data() + next_entry_ptrs.size());
+    std::sort(begin(next_entry_ptrs), end(next_entry_ptrs), by_score);
+    for (auto* ptr : next_entry_ptrs) {
+        if (!call(*ptr, false))
+            return;
+    }
+
+    std::array<Entry*, SearchContext<TState>::KILLER_SLOTS> killers{};
+    if constexpr (HasCheapMoveScore<TState>::value) {
+        for (int k = 0; k < SearchContext<TState>::KILLER_SLOTS && ctx.killers[depth][k]; k++) {
+            for (auto& entry : next_entries) {
+                if (entry.deferred && entry.move == *ctx.killers[depth][k] && remaining(entry)) {
+                    killers[k] = &entry;
+                    evaluate(entry);
+                    if (!call(entry, false))
+                        return;
+                    break;
+                }
+            }
+        }
+    }
 
-    std::sort(begin(next_entry_ptrs), end(next_entry_ptrs),
-        [&](const auto* a, const auto* b) { return a->score < b->score; });
+    next_entry_ptrs.clear();
+    for (auto& entry : next_entries) {
+        if (entry.deferred && std::find(begin(killers), end(killers), &entry) == end(killers) && remaining(entry)) {
+            next_entry_ptrs.push_back(&entry);
+        }
+    }
+    std::sort(begin(next_entry_ptrs), end(next_entry_ptrs), by_history);
+    // 最初の手でbeta cutすることが多いので、最初の手だけは1つで評価する
+    const int n_rest = int(next_entry_ptrs.size());
+    for (int i = 0, evaluated = 0; i < n_rest; i++) {
+        if (i == evaluated) {
+            evaluated = i == 0 ? 1 : std::min(n_rest, i + HasBatchEval<FEval, TState>::size);
+            evaluateRange(&next_entry_ptrs[i], next_entry_ptrs.data() + evaluated);
+        }
+        if (!call(*next_entry_ptrs[i], false))
+            return;
+    }
+}
 
-    for (int i = 0; i < int(next_entry_ptrs.size()); i++) {
-        auto* ptr = next_entry_ptrs[i];
-        auto& [score, next_move, next_state] = *ptr;
-        bool cont = func(score, next_move, next_state, ptr - next_entries.data(), false);
-        if (!cont)
-            break;
+//! historyを半分にし、古い探索の結果の影響を減らす。反復深化の各反復の始めに呼ぶ。
+template <class TState>
+void ageHistory(SearchContext<TState>& ctx)
+{
+    for (auto& h : ctx.history) {
+        h /= 2;
+    }
+}
+
+/*!
+ * beta cutを起こした手を覚える。
+ * 後回しにした手ならkillerにし、historyに残り深さの2乗を足す。
+ */
+template <class TState>
+void registerCutoff(SearchContext<TState>& ctx, int depth, int remaining_depth, const TState& state, const Move<TState>& move)
+{
+    if constexpr (HasCheapMoveScore<TState>::value) {
+        auto& killers = ctx.killers[depth];
+        if (state.cheapMoveScore(move) && !(killers[0] && *killers[0] == move)) {
+            std::move_backward(begin(killers), end(killers) - 1, end(killers));
+            killers[0] = move;
+        }
+    }
+    if constexpr (HasMoveKey<TState>::value) {
+        int32_t& h = ctx.history[TState::moveKey(move)];
+        h += remaining_depth * remaining_depth;
+        if (h > SearchContext<TState>::HISTORY_MAX) {
+            ageHistory(ctx);
+        }
     }
 }
 
@@ -164,13 +723,25 @@ struct Result {
     }
     int depth;
     TScore score;
+    //! stop()で打ち切られた。hasMove()なら、打ち切るまでに探索し終えた手のうちの最善手を持ち、scoreはその評価値の下限
+    bool aborted = false;
 #ifdef NORANDOM
     Move<TState> move;
+    bool has_move = false;
     void setMove(const Move<TState>& move, bool same = false)
     {
         if (same)
             return;
         this->move = move;
+        has_move = true;
+    }
+    bool hasMove() const
+    {
+        return has_move;
+    }
+    void clearMove()
+    {
+        has_move = false;
     }
     Move<TState> getMove()
     {
@@ -191,6 +762,14 @@ struct Result {
             this->move.clear();
         this->move.push_back(move);
     }
+    bool hasMove() const
+    {
+        return !move.empty();
+    }
+    void clearMove()
+    {
+        move.clear();
+    }
     Move<TState> getMove()
     {
         return this->move[std::uniform_int_distribution{0, int(this->move.size()) - 1}(rng)];
@@ -218,49 +797,129 @@ struct Result<TState, false> {
 int verbose_depth = -1;
 int verbose_search_depth = -1;
 
+/*!
+ * 置換表を引き、見つかった最善手をhash_move_idに入れる。
+ * 十分深く探索されたエントリならalpha, betaを狭め、それで打ち切れる場合はそのスコアを返す。
+ */
+template <bool toplevel, class TState>
+std::optional<TScore> probeHashTable(SearchContext<TState>& ctx, const TState& state, int depth, int remaining_depth, TScore& alpha, TScore& beta, int& hash_move_id)
+{
+    ctx.search_stats.tt_probes++;
+    const auto entry = ctx.table->probe(state);
+    if (!entry)
+        return std::nullopt;
+    ctx.search_stats.tt_hits++;
+    hash_move_id = entry->move;
+    if constexpr (!toplevel) {
+        if (entry->depth >= remaining_depth) {
+            if (entry->bound() == Bound::Lower && alpha < entry->score) {
+                alpha = entry->score;
+            } else if (entry->bound() == Bound::Upper && entry->score < beta) {
+                beta = entry->score;
+            }
+            if (entry->bound() == Bound::Exact || beta <= alpha) {
+                // 置換表で打ち切る場合、この下の最良手テーブルは信用できないので捨てる
+                ctx.best_path_table[depth][depth] = entry->move;
+                std::fill(&ctx.best_path_table[depth][depth + 1], &ctx.best_path_table[depth][ctx.search_depth], -1);
+                ctx.search_stats.tt_cuts++;
+                return entry->score;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+//! 探索結果を置換表に保存する。alphaは置換表で狭めた後の値を渡す。
+template <class TState>
+void storeHashTable(SearchContext<TState>& ctx, const TState& state, TScore score, int remaining_depth, TScore alpha, TScore beta, int best_index)
+{
+    if (best_index == -1)
+        return;
+    Bound bound = score <= alpha ? Bound::Upper : beta <= score ? Bound::Lower : Bound::Exact;
+    ctx.table->store(state, score, remaining_depth, bound, best_index);
+}
+
+/*!
+ * stop()で打ち切ったノードの結果にする。
+ * 根なら、打ち切るまでに探索し終えた手のうちの最善手を残す。ただし評価値がalpha0以下の手は探索窓より下で、良い手とは限らないので捨てる。
+ */
+template <class TState, bool toplevel>
+Result<TState, toplevel> abortedResult(Result<TState, toplevel> ret, TScore alpha0)
+{
+    if constexpr (toplevel) {
+        ret.aborted = true;
+        if (ret.score <= alpha0)
+            ret.clearMove();
+    }
+    return ret;
+}
+
+/*!
+ * stop()がtrueになったら、ctx.abortedを立てて探索の値を使わずに根まで戻る。根の結果はabortedResultにする。
+ * @param depth 根からの手数
+ * @param reduction 根からここまででlate move reductionにより減らした深さの合計。残り深さはctx.search_depth - depth - reduction
+ */
 template <bool toplevel, class TState, class FEval, class FStop>
-Result<TState, toplevel> negascout(const TState& state, const FEval& eval, TScore score0, int depth, TScore alpha, TScore beta, bool is_best_path, const FStop& stop)
+Result<TState, toplevel> negascout(SearchContext<TState>& ctx, const TState& state, const FEval& eval, TScore score0, int depth, TScore alpha, TScore beta, bool is_best_path, const FStop& stop, int reduction = 0)
 {
 
 #ifdef NOVERBOSE
 #define DEBUG(...)
 #else
-#define DEBUG(...)                                                                     \
-    if (depth <= verbose_depth && search_depth <= verbose_search_depth) {              \
-        std::cerr << depth << "/" << search_depth << ">" << __VA_ARGS__ << std::flush; \
+#define DEBUG(...)                                                                                  \
+    if (ctx.thread_id == 0 && depth <= verbose_depth && ctx.search_depth <= verbose_search_depth) { \
+        std::cerr << depth << "/" << ctx.search_depth << ">" << __VA_ARGS__ << std::flush;          \
     }
 #endif
     Result<TState, toplevel> ret = {};
-    ret.setDepth(search_depth);
-    if (std::abs(score0) == INF || depth == search_depth) {
+    ret.setDepth(ctx.search_depth);
+    const int remaining_depth = ctx.search_depth - depth - reduction;
+    if (std::abs(score0) == INF || remaining_depth <= 0) {
         ret.score = score0;
         return ret;
     }
+    ctx.nodes++;
 
-    if (depth < search_depth - 1 && stop()) {
-        throw Abort{};
+    if (remaining_depth > 1 && stop()) {
+        ctx.aborted = true;
+        return abortedResult(ret, alpha);
     }
 
+    int hash_move_id = -1;
+    if (auto cut = probeHashTable<toplevel>(ctx, state, depth, remaining_depth, alpha, beta, hash_move_id)) {
+        ret.score = *cut;
+        return ret;
+    }
+
+    const TScore alpha0 = alpha;
+
     DEBUG(std::string(depth, '\t') << "[\n")
 
     ret.score = -INF - 100;
+    int best_index = -1;
     bool first = true;
-    forEachSortedNextMoves(state, eval,
+    int move_count = 0;
+    forEachSortedNextMoves(ctx, depth, state, eval,
         [&](TScore eval_score, const Move<TState>& m, const NextState<TState>& next_state, int index, bool is_best) {
+            if constexpr (toplevel) {
+                if (std::find(begin(ctx.root_excluded), end(ctx.root_excluded), index) != end(ctx.root_excluded))
+                    return true;
+            }
             auto registerBestMove = [&](const auto& m, TScore score) {
                 if (ret.score < score) {
                     ret.setMove(m);
                     ret.score = score;
-                    best_path_table[depth][depth] = index;
-                    std::memcpy(&best_path_table[depth][depth + 1], &best_path_table[depth + 1][depth + 1], sizeof(int) * (search_depth - depth - 1));
+                    best_index = index;
+                    ctx.best_path_table[depth][depth] = index;
+                    std::memcpy(&ctx.best_path_table[depth][depth + 1], &ctx.best_path_table[depth + 1][depth + 1], sizeof(int) * (ctx.search_depth - depth - 1));
                     DEBUG(std::string(depth + 1, '\t') << "REWRITE: ");
 #ifndef NOVERBOSE
-                    if (depth <= verbose_depth && search_depth <= verbose_search_depth) {
-                        for (int i = 0; i < search_depth; i++) {
+                    if (ctx.thread_id == 0 && depth <= verbose_depth && ctx.search_depth <= verbose_search_depth) {
+                        for (int i = 0; i < ctx.search_depth; i++) {
                             if (i < depth) {
                                 std::cerr << "* ";
                             } else {
-                                std::cerr << best_path_table[depth][i] << " ";
+                                std::cerr << ctx.best_path_table[depth][i] << " ";
                             }
                         }
                         std::cerr << '\n'
@@ -272,10 +931,34 @@ Result<TState, toplevel> negascout(const TState& state, const FEval& eval, TScor
                 }
             };
 
-            TScore score = first ? alpha : -negascout<false>(next_state, eval, eval_score, depth + 1, -alpha - 1, -alpha, is_best, stop).score;
+            TScore score = alpha;
+            if (!first) {
+                // 静かな手は浅く探索してみて、alphaを超えたら元の深さで探索し直す
+                int r = 0;
+                if constexpr (HasCheapMoveScore<TState>::value) {
+                    const auto& killers = ctx.killers[depth];
+                    if (index != hash_move_id && state.cheapMoveScore(m) && std::find(begin(killers), end(killers), m) == end(killers))
+                        r = ctx.lmr.reduction(remaining_depth, move_count);
+                }
+                score = -negascout<false>(ctx, next_state, eval, eval_score, depth + 1, -alpha - 1, -alpha, is_best, stop, reduction + r).score;
+                if (ctx.aborted)
+                    return false;
+                if (r > 0) {
+                    ctx.lmr_stats.reduced++;
+                    if (alpha < score) {
+                        ctx.lmr_stats.researched++;
+                        score = -negascout<false>(ctx, next_state, eval, eval_score, depth + 1, -alpha - 1, -alpha, is_best, stop, reduction).score;
+                        if (ctx.aborted)
+                            return false;
+                    }
+                }
+            }
+            move_count++;
 
             if (beta <= score) {
                 registerBestMove(m, score);
+                registerCutoff(ctx, depth, remaining_depth, state, m);
+                ctx.search_stats.later_cuts++;
                 DEBUG((is_best ? '*' : ' ') << std::string(depth + 1, '\t') << "[" << index << "]" << m << ": " << score << "+ scout beta cut\n\n");
                 return false;
             }
@@ -285,11 +968,17 @@ Result<TState, toplevel> negascout(const TState& state, const FEval& eval, TScor
                 alpha = score;
                 if constexpr (no_random && toplevel)
                     alpha = score - 1;
+                if (!first)
+                    ctx.search_stats.researches++;
 
-                score = -negascout<false>(next_state, eval, eval_score, depth + 1, -beta, -alpha, is_best, stop).score;
+                score = -negascout<false>(ctx, next_state, eval, eval_score, depth + 1, -beta, -alpha, is_best, stop, reduction).score;
+                if (ctx.aborted)
+                    return false;
 
                 if (beta <= score) {
                     registerBestMove(m, score);
+                    registerCutoff(ctx, depth, remaining_depth, state, m);
+                    (first ? ctx.search_stats.first_move_cuts : ctx.search_stats.later_cuts)++;
                     DEBUG((is_best ? '*' : ' ') << std::string(depth + 1, '\t') << "[" << index << "]" << m << ": " << score << "+ beta cut\n\n");
                     return false;
                 }
@@ -304,32 +993,85 @@ Result<TState, toplevel> negascout(const TState& state, const FEval& eval, TScor
             first = false;
             return true;
         },
-        (is_best_path && depth < table_depth) ? best_path_table[0][depth] : -1);
+        (is_best_path && depth < ctx.table_depth) ? ctx.best_path_table[0][depth] : -1, hash_move_id);
 
 
     DEBUG(std::string(depth, '\t') << "]\n\n")
 
+    if (ctx.aborted)
+        return abortedResult(ret, alpha0);
+    // 手を除いた根の評価値は、その局面の評価値ではないので置換表に残さない
+    if (!toplevel || ctx.root_excluded.empty())
+        storeHashTable(ctx, state, ret.score, remaining_depth, alpha0, beta, best_index);
+
     //    if (ret.score == -INF - 100)
     //        ret.score = -INF;
     return ret;
 }
 
 template <class TState, class FEval>
-auto negascout(const TState& state, const FEval& eval, int depth)
+auto negascout(SearchContext<TState>& ctx, const TState& state, const FEval& eval, int depth)
 {
-    search_depth = depth;
-    table_depth = 0;
-    return negascout<true>(state, eval, eval(state), 0, -INF, INF, false, [] { return false; });
+    ctx.search_depth = depth;
+    ctx.table_depth = 0;
+    ctx.aborted = false;
+    return negascout<true>(ctx, state, eval, eval(state), 0, -INF, INF, false, [] { return false; });
 }
 
 
+/*!
+ * 反復深化の1回分の探索。
+ * 前回までの反復の評価値があれば、それを中心にctx.aspiration_windowの幅の窓で探索する。
+ * 評価値が窓の外に出たら、その側の窓を倍々に広げて探索し直す。
+ * 手番が変わるたびに評価値が上下しやすいので、中心には2つ前の深さの評価値を優先して使う。
+ * stop()で打ち切られたら、結果のabortedが立つ。打ち切るまでに良い手が見つかっていれば、結果はその手を持つ(Result::hasMove)。
+ */
 template <class TState, class FEval, class FStop>
-auto iterativeDeepeningNegascout(const TState& state, const FEval& eval, int depth, int last_depth, const FStop& stop)
+auto iterativeDeepeningNegascout(SearchContext<TState>& ctx, const TState& state, const FEval& eval, int depth, int last_depth, const FStop& stop)
 {
-    search_depth = depth;
-    table_depth = last_depth;
-    //    return negascout<true>(state, eval, eval(state), 0, -INF, INF, true, stop);
-    auto ret = negascout<true>(state, eval, eval(state), 0, -INF, INF, true, stop);
-    //    std::cerr << std::endl;
-    return ret;
+    ctx.search_depth = depth;
+    ctx.table_depth = last_depth;
+    ctx.aborted = false;
+    ageHistory(ctx);
+    if (last_depth <= 0) {
+        std::fill(begin(ctx.iteration_scores), end(ctx.iteration_scores), std::nullopt);
+    }
+    const TScore score0 = eval(state);
+    std::optional<TScore> center = depth >= 2 && ctx.iteration_scores[depth - 2] ? ctx.iteration_scores[depth - 2] : ctx.iteration_scores[last_depth];
+    TScore delta = ctx.aspiration_window;
+    if (!center || delta <= 0 || std::abs(*center) >= INF) {
+        auto ret = negascout<true>(ctx, state, eval, score0, 0, -INF, INF, true, stop);
+        if (!ret.aborted)
+            ctx.iteration_scores[depth] = ret.score;
+        return ret;
+    }
+
+    ctx.aspiration_stats.searches++;
+    auto bound = [](int64_t score) { return TScore(std::clamp<int64_t>(score, -INF, INF)); };
+    TScore alpha = bound(int64_t(*center) - delta);
+    TScore beta = bound(int64_t(*center) + delta);
+    Result<TState> fail_high = {};  //! 窓より上に出た探索の結果。探し直しが打ち切られたときに使う
+    while (true) {
+        auto ret = negascout<true>(ctx, state, eval, score0, 0, alpha, beta, true, stop);
+        if (ret.aborted) {
+            if (fail_high.hasMove() && (!ret.hasMove() || ret.score < fail_high.score)) {
+                fail_high.aborted = true;
+                return fail_high;
+            }
+            return ret;
+        }
+        if (ret.score <= alpha && alpha > -INF) {
+            ctx.aspiration_stats.fail_low++;
+            delta = delta > INF / 2 ? INF : delta * 2;
+            alpha = bound(int64_t(std::min(ret.score, alpha)) - delta);
+        } else if (beta <= ret.score && beta < INF) {
+            ctx.aspiration_stats.fail_high++;
+            fail_high = ret;
+            delta = delta > INF / 2 ? INF : delta * 2;
+            beta = bound(int64_t(std::max(ret.score, beta)) + delta);
+        } else {
+            ctx.iteration_scores[depth] = ret.score;
+            return ret;
+        }
+    }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include "negaalpha.hpp"
 #include "quoridor.hpp"
+#include "time_manager.hpp"
 #include <algorithm>
 #include <chrono>
 #include <fstream>
@@ -19,8 +20,18 @@ int main(int argc, const char** argv)
     //    std::ifstream in(argv[1]);
     //    std::ofstream out(argv[2]);
 
+    TimeControl time_control;
+    for (int i = 1; i < argc; i++) {
+        if (!time_control.parseOption(i, argc, argv)) {
+            std::cerr << "Usage: negascout " << TimeControl::USAGE << std::endl;
+            return 1;
+        }
+    }
+
     verbose_depth = 4;
     verbose_search_depth = 7;
+    SearchContext<Quoridor::State> ctx;
+    TimeManager time_manager(time_control, 1);
     while (true) {
         Quoridor::State s{};
         std::cin >> s;
@@ -32,37 +43,46 @@ int main(int argc, const char** argv)
         std::cerr << s << "\n\n";
         std::cerr << s.pretty() << '\n';
 
+        hash_table<Quoridor::State>.newTurn();
+        time_manager.startTurn();
         auto start_time = std::chrono::steady_clock::now();
         Result<Quoridor::State> res = {};
-        try {
-            for (int i = 1; i <= 20; i++) {
-                res = iterativeDeepeningNegascout(s,
-                    [&](const Quoridor::State& state) {
-                        if (state.lose())
-                            return -INF;
-                        return -search(state, state.my_pos, [&](const Quoridor::Position& p) { return p.y == 0; })
-                               + search(state, state.opponent_pos, [&](const Quoridor::Position& p) { return p.y == Quoridor::N - 1; });
-                    },
-                    i,
-                    i - 1,
-                    [&] {
+        for (int i = 1; i <= 20; i++) {
+            auto current = iterativeDeepeningNegascout(ctx, s,
+                [&](const Quoridor::State& state) {
+                    if (state.lose())
+                        return -INF;
+                    return -search(state, state.my_pos, [&](const Quoridor::Position& p) { return p.y == 0; })
+                           + search(state, state.opponent_pos, [&](const Quoridor::Position& p) { return p.y == Quoridor::N - 1; });
+                },
+                i,
+                i - 1,
+                [&] {
 #ifdef NDEBUG
-                        return std::chrono::steady_clock::now() - start_time >= std::chrono::milliseconds(980);
+                    return time_manager.stop();
 #else
-                        return false;
+                    return false;
 #endif
-                    });
-
-                std::cerr << res << " @ " << (std::chrono::steady_clock::now() - start_time).count() / 1.0e6 << "ms" << std::endl;
+                });
+            // 打ち切られても、探索し終えた手の中に良い手があればそれを使う
+            if (current.aborted) {
+                if (current.hasMove())
+                    res = current;
+                break;
             }
-        } catch (Abort&) {
-        }
+            res = current;
 
+            std::cerr << res << " @ " << (std::chrono::steady_clock::now() - start_time).count() / 1.0e6 << "ms" << std::endl;
+            if (!time_manager.onIteration(i, ctx.best_path_table[0][0], res.score))
+                break;
+        }
 
         auto m = res.getMove();
         std::cerr << m << std::endl;
+        std::cerr << ctx.aspiration_stats << std::endl;
 
         std::cout << m << std::endl;
+        time_manager.endTurn();
     }
     return 0;
 }
\ No newline at end of file
@@ -1,89 +1,403 @@
 #include <array>
 
+#include "analysis_server.hpp"
+#include "engine_protocol.hpp"
+#include "evaluator.hpp"
 #include "negaalpha.hpp"
+#include "parallel_negascout.hpp"
 #include "quoridor_fast.hpp"
+#include "time_manager.hpp"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <optional>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 
 int main(int argc, const char** argv)
 {
     std::ios_base::sync_with_stdio(false);
 
+    int threads = 1;
+    bool split = false;
+    bool ponder = false;
+    bool binary = false;
+    std::optional<std::string> serve_address;
+    std::optional<TScore> aspiration_window;
+    LateMoveReduction lmr;
+    std::ofstream stats_out;
+    TimeControl time_control;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--hash" && i + 1 < argc) {
+            hash_table<QuoridorFast::State>.resize(std::stoul(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--split") {
+            split = true;
+        } else if (arg == "--aspiration" && i + 1 < argc) {
+            aspiration_window = std::stoi(argv[++i]);
+        } else if (arg == "--lmr") {
+            lmr.enabled = true;
+        } else if (arg == "--lmr-moves" && i + 1 < argc) {
+            lmr.min_moves = std::stoi(argv[++i]);
+        } else if (arg == "--lmr-table" && i + 2 < argc) {
+            double base = std::stod(argv[++i]);
+            double divisor = std::stod(argv[++i]);
+            lmr.setTable(base, divisor);
+        } else if (time_control.parseOption(i, argc, argv)) {
+        } else if (arg == "--ponder") {
+            ponder = true;
+        } else if (arg == "--binary") {
+            binary = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serve_address = argv[++i];
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_out.open(argv[++i], std::ios::app);
+            if (!stats_out) {
+                std::cerr << "cannot open " << argv[i] << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage: negascout-fast [--hash <MB>] [--threads <N>] [--split] [--aspiration <window>]"
+                         " [--lmr] [--lmr-moves <K>] [--lmr-table <base> <divisor>] [--ponder] [--binary] [--serve <port>|unix:<path>] [--stats <file>] "
+                      << TimeControl::USAGE
+                      << std::endl;
+            return 1;
+        }
+    }
+
     verbose_depth = 4;
     verbose_search_depth = 7;
-    while (true) {
+
+    const QuoridorFast::Evaluate eval;
+
+    constexpr int max_depth =
+#ifdef NDEBUG
+        20
+#else
+        2
+#endif
+        ;
+
+    // --splitならYBWで兄弟を分け合い、そうでなければLazy SMPで置換表を共有する
+    std::optional<SplitSearch<QuoridorFast::State>> split_search;
+    if (split) {
+        split_search.emplace(threads);
+        threads = 1;
+    }
+    std::vector<SearchContext<QuoridorFast::State>> contexts(threads);
+    for (int t = 0; t < threads; t++) {
+        contexts[t].thread_id = t;
+        contexts[t].lmr = lmr;
+        if (aspiration_window)
+            contexts[t].aspiration_window = *aspiration_window;
+    }
+
+    // 手を決めるスレッドの探索のカウンタ。--splitなら全てのワーカーの合計。
+    auto counters = [&] {
+        if (!split_search)
+            return SearchCounters::of(contexts[0]);
+        SearchCounters sum;
+        for (auto& ctx : split_search->contexts) {
+            sum += SearchCounters::of(ctx);
+        }
+        return sum;
+    };
+
+    /*
+     * sを深さfirst_depthからmax_depthまで反復深化で探索し、結果と探索し終えた深さを返す。
+     * 打ち切った深さで、打ち切るまでに良い手が見つかっていれば、結果はその手にする。
+     * first_depth > 1なら、深さfirst_depth - 1までの探索が済んでいて、その結果がresで、最良手テーブルと評価値がcontexts[0]に残っているものとする。
+     * stop()がtrueになったら打ち切る。stop_timeは打ち切りを決めた時刻で、統計のabort_latency_msに使う。
+     * 深さを1つ探索し終えるたびにkeepGoing(深さ, 結果)を呼び、falseなら次の深さを探索しない。
+     */
+    auto think = [&](const QuoridorFast::State& s, int turn, bool pondering, int first_depth, Result<QuoridorFast::State> res,
+                     std::chrono::steady_clock::time_point start_time, const auto& stop, const std::chrono::steady_clock::time_point& stop_time,
+                     const auto& keepGoing) {
+        // Lazy SMP: ヘルパースレッドは置換表を共有して同じ局面を深さをずらしながら探索する。
+        // 手を決めるのはメインスレッドだけで、ヘルパーの結果は置換表を通してのみ使われる。
+        StopFlag stop_helpers;
+        std::vector<std::thread> helpers;
+        for (int t = 1; t < threads; t++) {
+            helpers.emplace_back([&, t] {
+                auto& ctx = contexts[t];
+                int last_depth = 0;
+                for (int i = 1 + t % 2; i <= max_depth; i += 1 + (t / 2) % 2) {
+                    if (iterativeDeepeningNegascout(ctx, s, eval, i, last_depth, stop_helpers).aborted)
+                        break;
+                    last_depth = i;
+                }
+            });
+        }
+
+        /*
+         * --statsなら反復ごとに、その反復で増えたカウンタをJSONの1行にして書き出す。
+         * ebfは前の反復とのノード数の比、potential_searchesはメインスレッドで行った回数。
+         * 打ち切った反復は、打ち切りを決めてから探索を抜けるまでの時間をabort_latency_msに入れる。
+         */
+        SearchCounters last_counters = counters();
+        uint64_t last_potential_searches = QuoridorFast::potential_search_count;
+        uint64_t last_nodes = 0;
+        auto writeStats = [&](int depth, std::optional<TScore> score, std::optional<double> abort_latency_ms) {
+            if (!stats_out.is_open())
+                return;
+            auto now = std::chrono::steady_clock::now();
+            SearchCounters current = counters();
+            SearchCounters diff = current - last_counters;
+            stats_out << "{\"turn\":" << turn << ",\"ponder\":" << (pondering ? "true" : "false") << ",\"depth\":" << depth
+                      << ",\"ms\":" << std::chrono::duration<double, std::milli>(now - start_time).count();
+            if (score)
+                stats_out << ",\"score\":" << *score;
+            stats_out << ',';
+            diff.writeJsonMembers(stats_out);
+            stats_out << ",\"potential_searches\":" << QuoridorFast::potential_search_count - last_potential_searches;
+            if (last_nodes > 0)
+                stats_out << ",\"ebf\":" << double(diff.nodes) / double(last_nodes);
+            stats_out << ",\"aborted\":" << (abort_latency_ms ? "true" : "false");
+            if (abort_latency_ms)
+                stats_out << ",\"abort_latency_ms\":" << *abort_latency_ms;
+            stats_out << '}' << std::endl;
+            last_counters = current;
+            last_potential_searches = QuoridorFast::potential_search_count;
+            last_nodes = diff.nodes;
+        };
+
+        int completed = first_depth - 1;
+        for (int depth = first_depth; depth <= max_depth; depth++) {
+            auto current = split_search ? iterativeDeepeningParallelNegascout(*split_search, s, eval, depth, depth - 1, stop)
+                                        : iterativeDeepeningNegascout(contexts[0], s, eval, depth, depth - 1, stop);
+            if (current.aborted) {
+                const double latency = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stop_time).count();
+                if (current.hasMove()) {
+                    std::cerr << (pondering ? "ponder " : "") << "aborted " << current << std::endl;
+                    res = current;
+                    writeStats(depth, current.score, std::max(0.0, latency));
+                } else {
+                    writeStats(depth, std::nullopt, std::max(0.0, latency));
+                }
+                break;
+            }
+            res = current;
+
+            std::cerr << (pondering ? "ponder " : "") << res << " @ " << (std::chrono::steady_clock::now() - start_time).count() / 1.0e6 << "ms" << std::endl;
+            writeStats(depth, res.score, std::nullopt);
+            completed = depth;
+            if (!keepGoing(depth, res))
+                break;
+        }
+        stop_helpers.request();
+        for (auto& th : helpers) {
+            th.join();
+        }
+        return std::pair{res, completed};
+    };
+
+    // --serveなら、対局はせずに局面を分析するサーバーとして動く。探索はメインスレッドだけで行う
+    if (serve_address) {
+        const int fd = AnalysisServer::listenOn(*serve_address);
+        if (fd < 0)
+            return 1;
+        std::cerr << "Serving analysis on " << *serve_address << std::endl;
+        AnalysisServer::serve(fd, contexts[0], eval, max_depth, time_control);
+        return 0;
+    }
+
+    TimeManager time_manager(time_control, QuoridorFast::default_weights.step);
+
+    /*
+     * --ponderなら、手を出力した後、相手の応手を置換表の最善手で予想し、その局面を相手の手番の間に探索しておく。
+     * 予想が当たれば、その探索の結果と最良手テーブルを引き継いで続きの深さから探索する。
+     * 外れても置換表はそのまま使う。
+     */
+    std::thread ponder_thread;
+    StopFlag stop_ponder;
+    std::chrono::steady_clock::time_point ponder_stop_time;
+    std::optional<QuoridorFast::State> ponder_state;  //! ponderしている局面
+    std::pair<Result<QuoridorFast::State>, int> ponder_result;  //! ponderで探索し終えた結果と深さ
+    auto stopPondering = [&] {
+        if (!ponder_thread.joinable())
+            return;
+        ponder_stop_time = std::chrono::steady_clock::now();
+        stop_ponder.request();
+        ponder_thread.join();
+    };
+
+    /*
+     * --binaryならEngineProtocolのメッセージで局面を受け取り、手を返す。
+     * 'M'で受け取った相手の手は、直前に指した後の局面after_moveに進めて、次に指す局面にする。
+     */
+    std::optional<QuoridorFast::State> after_move;
+    auto writeBinary = [](const std::string& data) {
+        std::cout.write(data.data(), std::streamsize(data.size()));
+        std::cout.flush();
+    };
+    auto readBinary = [](uint8_t* data, std::size_t size) {
+        return bool(std::cin.read(reinterpret_cast<char*>(data), std::streamsize(size)));
+    };
+    auto writeError = [&](EngineProtocol::Error error) {
+        writeBinary(std::string{'E', char(error)});
+    };
+
+    //! 'A'の各局面を深さdepthまで探索して結果を返す。ponderの結果は使えなくなるので捨てる。
+    auto analyze = [&](int turn, int depth, const std::vector<QuoridorFast::State>& states) {
+        ponder_state.reset();
+        std::string reply{'A'};
+        EngineProtocol::append(reply, uint16_t(states.size()));
+        for (auto& s : states) {
+            uint8_t move = EngineProtocol::NO_MOVE;
+            TScore score = -INF;
+            int completed = 0;
+            if (!s.lose()) {
+                hash_table<QuoridorFast::State>.newTurn();
+                const auto now = std::chrono::steady_clock::now();
+                auto [res, reached] = think(s, turn, false, 1, Result<QuoridorFast::State>{}, now, [] { return false; }, now,
+                    [&](int d, const Result<QuoridorFast::State>&) { return d < depth; });
+                move = EngineProtocol::encodeMove(res.getMove());
+                score = res.score;
+                completed = reached;
+            }
+            reply.push_back(char(move));
+            EngineProtocol::append(reply, int32_t(score));
+            reply.push_back(char(completed));
+        }
+        writeBinary(reply);
+    };
+
+    //! 次に指す局面が来るまでメッセージを読む。入力が終わるか'Q'ならstd::nullopt
+    auto readPosition = [&](int turn) -> std::optional<QuoridorFast::State> {
+        while (true) {
+            uint8_t type;
+            if (!readBinary(&type, 1) || type == 'Q')
+                return std::nullopt;
+            if (type == 'P') {
+                std::array<uint8_t, EngineProtocol::STATE_SIZE> data;
+                if (!readBinary(data.data(), data.size()))
+                    return std::nullopt;
+                if (auto s = EngineProtocol::decodeState(data.data()))
+                    return s;
+                writeError(EngineProtocol::Error::BadMessage);
+            } else if (type == 'M') {
+                uint8_t code;
+                if (!readBinary(&code, 1))
+                    return std::nullopt;
+                const auto m = EngineProtocol::decodeMove(code);
+                auto next = m && after_move ? after_move->move(*m) : std::nullopt;
+                if (next)
+                    return next;
+                writeError(m ? EngineProtocol::Error::NoPosition : EngineProtocol::Error::BadMessage);
+            } else if (type == 'A') {
+                uint8_t header[3];
+                if (!readBinary(header, sizeof(header)))
+                    return std::nullopt;
+                const int depth = std::clamp(int(header[0]), 1, max_depth);
+                std::vector<QuoridorFast::State> states;
+                bool ok = true;
+                for (int i = 0; i < EngineProtocol::read<uint16_t>(header + 1); i++) {
+                    std::array<uint8_t, EngineProtocol::STATE_SIZE> data;
+                    if (!readBinary(data.data(), data.size()))
+                        return std::nullopt;
+                    auto s = EngineProtocol::decodeState(data.data());
+                    ok = ok && s;
+                    if (s)
+                        states.push_back(*s);
+                }
+                stopPondering();
+                if (ok) {
+                    analyze(turn, depth, states);
+                } else {
+                    writeError(EngineProtocol::Error::BadMessage);
+                }
+            } else {
+                writeError(EngineProtocol::Error::BadMessage);
+            }
+        }
+    };
+
+    for (int turn = 0;; turn++) {
         QuoridorFast::State s{};
-        std::cin >> s;
+        if (binary) {
+            auto next = readPosition(turn);
+            stopPondering();
+            if (!next) {
+                std::cerr << "end of input" << std::endl;
+                return 0;
+            }
+            s = *next;
+        } else {
+            std::cin >> s;
+            stopPondering();
 
-        if (std::cin.eof()) {
-            std::cerr << "in.eof()" << std::endl;
-            return 0;
+            if (std::cin.eof()) {
+                std::cerr << "in.eof()" << std::endl;
+                return 0;
+            }
         }
         std::cerr << s << "\n\n";
         std::cerr << s.pretty() << '\n';
 
+        time_manager.startTurn();
         auto start_time = std::chrono::steady_clock::now();
-        Result<QuoridorFast::State> res = {};
-        try {
-            for (int i = 1; i <=
-#ifdef NDEBUG
-                            20
-#else
-                            2
-#endif
-                 ;
-                 i++) {
-                res = iterativeDeepeningNegascout(s,
-                    [](const QuoridorFast::State& state) {
-                        if (state.lose())
-                            return -INF;
-                        auto hfullwall = state.hFullWall();
-                        auto vfullwall = state.vFullWall();
-                        int myps = QuoridorFast::potentialSearch(hfullwall, vfullwall, QuoridorFast::my_goal, QuoridorFast::BitBoard::oneHot(state.my_pos));
-                        int oppps = QuoridorFast::potentialSearch(hfullwall, vfullwall, QuoridorFast::BitBoard::oneHot(state.opponent_pos), QuoridorFast::opponent_goal);
-                        if (myps == -1 || oppps == -1)
-                            return INF;
-                        int my_dist = myps + state.my_pos.y;
-                        int opp_dist = oppps + QuoridorFast::N - 1 - state.opponent_pos.y;
-                        //                        std::cerr << state.pretty() << std::endl
-                        //                                  << my_dist << " " << opp_dist << " " << opp_dist - my_dist << std::endl;
-                        //auto wall_func = [](int x) { return int(std::log(x + 0.3) * 8 * 100000); };
-                        auto wall_func = [](int self, int opponent) {
-                            return int(std::tanh(opponent * 0.3) * (1.2 * self - 4.0 / (self + 0.3)) * 100000);
-                        };
-                        /*if(s.my_rem_walls != s.opponent_rem_walls)
-                            std::cerr<<s.my_rem_walls << s.opponent_rem_walls
-                            <<" " <<cube(s.my_rem_walls - s.opponent_rem_walls)* 100023
-                            << " " << ((opp_dist - my_dist) * 100000 + cube(s.my_rem_walls - s.opponent_rem_walls) * 100023)<<std::endl;
-                        */
-
-
-                        return ((opp_dist - my_dist) * 100000 + wall_func(state.my_rem_walls, state.opponent_rem_walls) - wall_func(state.opponent_rem_walls, state.my_rem_walls));  // * 4 + s.my_rem_walls * 1 + cube(s.my_rem_walls - s.opponent_rem_walls);
-                    },
-                    i,
-                    i - 1,
-                    [&] {
+        const auto deadline = time_manager.deadline();
+        auto stop = [&] {
 #ifdef NDEBUG
-                        return std::chrono::steady_clock::now() - start_time >= std::chrono::milliseconds(980);
+            return time_manager.stop();
 #else
-                        return false;
+            return false;
 #endif
-                    });
+        };
+        auto keepGoing = [&](int depth, const Result<QuoridorFast::State>& res) {
+            const auto& ctx = split_search ? split_search->contexts[0] : contexts[0];
+            return time_manager.onIteration(depth, ctx.best_path_table[0][0], res.score);
+        };
 
-                std::cerr << res << " @ " << (std::chrono::steady_clock::now() - start_time).count() / 1.0e6 << "ms" << std::endl;
-            }
-        } catch (Abort&) {
+        std::pair<Result<QuoridorFast::State>, int> result;
+        if (ponder_state)
+            std::cerr << (*ponder_state == s ? "ponder hit: depth " + std::to_string(ponder_result.second) : std::string("ponder miss")) << std::endl;
+        if (ponder_state && *ponder_state == s && ponder_result.second > 0) {
+            result = ponder_result.second < max_depth
+                         ? think(s, turn, false, ponder_result.second + 1, ponder_result.first, start_time, stop, deadline, keepGoing)
+                         : ponder_result;
+        } else {
+            hash_table<QuoridorFast::State>.newTurn();
+            result = think(s, turn, false, 1, Result<QuoridorFast::State>{}, start_time, stop, deadline, keepGoing);
         }
-
+        ponder_state.reset();
+        auto& res = result.first;
 
         auto m = res.getMove();
         std::cerr << m << std::endl;
+        if (!split_search)
+            std::cerr << contexts[0].aspiration_stats << '\n'
+                      << contexts[0].lmr_stats << std::endl;
+
+        if (binary) {
+            after_move = s.move(m);
+            writeBinary(std::string{'M', char(EngineProtocol::encodeMove(m))});
+        } else {
+            std::cout << m << std::endl;
+        }
+        time_manager.endTurn();
 
-        std::cout << m << std::endl;
+        if (ponder && result.second > 0) {
+            auto after = s.move(m);
+            auto reply = after ? hashMove(*after) : std::nullopt;
+            if (reply && !reply->second.lose()) {
+                ponder_state = reply->second;
+                hash_table<QuoridorFast::State>.newTurn();
+                stop_ponder.reset();
+                ponder_thread = std::thread([&, turn] {
+                    ponder_result = think(*ponder_state, turn + 1, true, 1, Result<QuoridorFast::State>{}, std::chrono::steady_clock::now(),
+                        stop_ponder, ponder_stop_time,
+                        [](int, const Result<QuoridorFast::State>&) { return true; });
+                });
+            }
+        }
     }
     return 0;
 }
@@ -0,0 +1,246 @@
+#pragma once
+#include "negaalpha.hpp"
+#include "work_stealing_pool.hpp"
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+/*!
+ * Young Brothers Waitによる並列negascout。
+ * 各ノードで最初の子は自分で探索し、残りの兄弟をスレッドプールに渡す。
+ * 兄弟のどれかでbeta cutが起きたら、そのノードの残りの兄弟の探索を取り消す。
+ * 残り深さがMIN_SPLIT_DEPTH未満のノードは普通のnegascoutで探索する。
+ * 兄弟の取り消しや時間切れでは、例外を使わず、ワーカーのSearchContext::abortedを立てて戻る。
+ */
+template <class TState>
+struct SplitSearch {
+    static constexpr int MIN_SPLIT_DEPTH = 3;
+
+    //! 並べ替えた子の1つ。兄弟を探索し終えるまで、その親を探索しているワーカーのchildrenに置いておく
+    struct Child {
+        TScore eval_score;
+        Move<TState> move;
+        NextState<TState> state;
+        int index;
+        bool is_best;
+    };
+
+    WorkStealingPool pool;
+    std::vector<SearchContext<TState>> contexts;  //! ワーカーごとの探索状態
+    //! ワーカーごと、深さごとの子の並び。探索中にヒープ確保しないよう、MoveListと同じく使い回す
+    std::vector<std::array<std::vector<Child>, MAX_DEPTH>> children;
+
+    explicit SplitSearch(int threads) : pool(threads), contexts(pool.size()), children(pool.size())
+    {
+        for (int i = 0; i < pool.size(); i++) {
+            contexts[i].thread_id = i;
+            for (auto& c : children[i]) {
+                c.reserve(MoveList<TState>::INITIAL_CAPACITY);
+            }
+        }
+    }
+};
+
+/*!
+ * 探索中のSplitPointの祖先関係。タスクのタグにも使う。
+ */
+struct SplitLink {
+    const std::atomic<bool>* cancelled;  //! このSplitPointの兄弟の探索が取り消されたか
+    const SplitLink* parent;
+
+    //! 自分か祖先のどれかが取り消されたか
+    bool isCancelled() const
+    {
+        for (const SplitLink* p = this; p != nullptr; p = p->parent) {
+            if (p->cancelled->load(std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+
+    bool isDescendantOf(const SplitLink* link) const
+    {
+        for (const SplitLink* p = this; p != nullptr; p = p->parent) {
+            if (p == link)
+                return true;
+        }
+        return false;
+    }
+};
+
+/*!
+ * 兄弟を並列に探索しているノード。
+ */
+template <class TState, bool toplevel>
+struct SplitPoint {
+    std::atomic<bool> cancelled{false};
+    std::atomic<TScore> alpha;
+    std::atomic<int> pending{0};
+
+    std::mutex mutex;
+    bool aborted = false;  //! 時間切れで、兄弟のどれかの探索が打ち切られた
+    Result<TState, toplevel> ret;
+    int best_index;
+    int best_path[MAX_DEPTH];
+};
+
+template <bool toplevel, class TState, class FEval, class FStop>
+Result<TState, toplevel> parallelNegascout(SplitSearch<TState>& search, int worker, const SplitLink* link,
+    const TState& state, const FEval& eval, TScore score0, int depth, TScore alpha, TScore beta, bool is_best_path, const FStop& stop)
+{
+    auto& ctx = search.contexts[worker];
+    auto local_stop = [&] { return stop() || (link != nullptr && link->isCancelled()); };
+    if (search.pool.size() == 1 || ctx.search_depth - depth < SplitSearch<TState>::MIN_SPLIT_DEPTH || std::abs(score0) == INF) {
+        return negascout<toplevel>(ctx, state, eval, score0, depth, alpha, beta, is_best_path, local_stop);
+    }
+    Result<TState, toplevel> ret = {};
+    ret.setDepth(ctx.search_depth);
+    if (local_stop()) {
+        ctx.aborted = true;
+        return abortedResult(ret, alpha);
+    }
+    ctx.nodes++;
+
+    const int remaining_depth = ctx.search_depth - depth;
+    int hash_move_id = -1;
+    if (auto cut = probeHashTable<toplevel>(ctx, state, depth, remaining_depth, alpha, beta, hash_move_id)) {
+        ret.score = *cut;
+        return ret;
+    }
+    const TScore alpha0 = alpha;
+
+    using Child = typename SplitSearch<TState>::Child;
+    auto& children = search.children[worker][depth];
+    children.clear();
+    forEachSortedNextMoves(ctx, depth, state, eval,
+        [&](TScore eval_score, const Move<TState>& m, const NextState<TState>& next_state, int index, bool is_best) {
+            children.push_back(Child{eval_score, m, next_state, index, is_best});
+            return true;
+        },
+        (is_best_path && depth < ctx.table_depth) ? ctx.best_path_table[0][depth] : -1, hash_move_id);
+    if (children.empty()) {
+        ret.score = -INF - 100;
+        return ret;
+    }
+
+    // 長男は自分で探索する
+    const Child& eldest = children.front();
+    ret.score = -parallelNegascout<false>(search, worker, link, eldest.state, eval, eldest.eval_score, depth + 1, -beta, -alpha, eldest.is_best, stop).score;
+    if (ctx.aborted) {
+        ret.score = -INF - 100;
+        return abortedResult(ret, alpha0);
+    }
+    ret.setMove(eldest.move);
+    int best_index = eldest.index;
+    ctx.best_path_table[depth][depth] = eldest.index;
+    std::copy(&ctx.best_path_table[depth + 1][depth + 1], &ctx.best_path_table[depth + 1][ctx.search_depth], &ctx.best_path_table[depth][depth + 1]);
+    if (beta <= ret.score) {
+        registerCutoff(ctx, depth, remaining_depth, state, eldest.move);
+        ctx.search_stats.first_move_cuts++;
+    }
+    if (beta <= ret.score || children.size() == 1) {
+        storeHashTable(ctx, state, ret.score, remaining_depth, alpha0, beta, best_index);
+        return ret;
+    }
+    if (alpha < ret.score)
+        alpha = ret.score;
+    if constexpr (no_random && toplevel)
+        alpha = ret.score - 1;
+
+    // 残りの兄弟を並列に探索する
+    SplitPoint<TState, toplevel> sp;
+    sp.alpha = alpha;
+    sp.ret = ret;
+    sp.best_index = best_index;
+    std::copy(&ctx.best_path_table[depth][depth], &ctx.best_path_table[depth][ctx.search_depth], &sp.best_path[depth]);
+    const SplitLink sp_link{&sp.cancelled, link};
+    sp.pending = int(children.size()) - 1;
+
+    auto searchSibling = [&](int w, int i) {
+        const Child& child = children[i];
+        auto& wctx = search.contexts[w];
+        // 探索し終えたら評価値を返す。取り消されたか打ち切られたらstd::nullopt
+        auto searchChild = [&]() -> std::optional<TScore> {
+            if (sp_link.isCancelled())
+                return std::nullopt;
+            TScore a = sp.alpha.load();
+            TScore score = -parallelNegascout<false>(search, w, &sp_link, child.state, eval, child.eval_score, depth + 1, -a - 1, -a, false, stop).score;
+            if (wctx.aborted)
+                return std::nullopt;
+            if (a < score && score < beta) {
+                wctx.search_stats.researches++;
+                score = -parallelNegascout<false>(search, w, &sp_link, child.state, eval, child.eval_score, depth + 1, -beta, -score, false, stop).score;
+                if (wctx.aborted)
+                    return std::nullopt;
+            }
+            return score;
+        };
+        // このタスクは待っている間に同じワーカーが手伝うこともあるので、abortedはタスクごとに戻す
+        const std::optional<TScore> result = searchChild();
+        wctx.aborted = false;
+        if (result) {
+            const TScore score = *result;
+            std::lock_guard lock{sp.mutex};
+            if (sp.ret.score < score) {
+                sp.ret.setMove(child.move);
+                sp.ret.score = score;
+                sp.best_index = child.index;
+                sp.best_path[depth] = child.index;
+                std::copy(&wctx.best_path_table[depth + 1][depth + 1], &wctx.best_path_table[depth + 1][wctx.search_depth], &sp.best_path[depth + 1]);
+            } else if (sp.ret.score == score) {
+                sp.ret.setMove(child.move, true);
+            }
+            if (sp.alpha.load() < score) {
+                sp.alpha = (no_random && toplevel) ? score - 1 : score;
+            }
+            if (beta <= score) {
+                // killerとhistoryは探索したワーカーのもの
+                registerCutoff(wctx, depth, remaining_depth, state, child.move);
+                wctx.search_stats.later_cuts++;
+                sp.cancelled = true;
+            }
+        } else if (!sp_link.isCancelled()) {
+            std::lock_guard lock{sp.mutex};
+            sp.aborted = true;
+        }
+        sp.pending--;
+    };
+    for (int i = 1; i < int(children.size()); i++) {
+        search.pool.push(worker, &sp_link, WorkStealingPool::Task::of(searchSibling, i));
+    }
+
+    // 兄弟の探索が終わるまで、その子孫のタスクを手伝う
+    while (sp.pending.load() > 0) {
+        bool ran = search.pool.runOne(worker, [&](const void* tag) {
+            return static_cast<const SplitLink*>(tag)->isDescendantOf(&sp_link);
+        });
+        if (!ran)
+            std::this_thread::yield();
+    }
+
+    // 祖先で打ち切られたか時間切れなら、結果は使えない。根なら探索し終えた兄弟の中の最善手は残す
+    if (sp.aborted || (link != nullptr && link->isCancelled())) {
+        ctx.aborted = true;
+        return abortedResult(sp.ret, alpha0);
+    }
+
+    std::copy(&sp.best_path[depth], &sp.best_path[ctx.search_depth], &ctx.best_path_table[depth][depth]);
+    storeHashTable(ctx, state, sp.ret.score, remaining_depth, alpha0, beta, sp.best_index);
+    return sp.ret;
+}
+
+
+template <class TState, class FEval, class FStop>
+auto iterativeDeepeningParallelNegascout(SplitSearch<TState>& search, const TState& state, const FEval& eval, int depth, int last_depth, const FStop& stop)
+{
+    for (auto& ctx : search.contexts) {
+        ctx.search_depth = depth;
+        ctx.table_depth = last_depth;
+        ctx.aborted = false;
+        ageHistory(ctx);
+    }
+    return parallelNegascout<true>(search, 0, nullptr, state, eval, eval(state), 0, -INF, INF, true, stop);
+}
@@ -0,0 +1,151 @@
+#include "quoridor.hpp"
+#include "quoridor_fast.hpp"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * 手の生成の速さと正しさを調べる。
+ * 局面ファイルの各局面から深さdepthまでの葉の数を、QuoridorFast::StateとQuoridor::Stateの両方で数え、
+ * それぞれの1秒あたりのノード数と、ルートの手ごとの葉の数が食い違った手を出力する。
+ * ルートの手をthreads個のスレッドで分け合って数えることもできる。
+ * 勝負がついた局面からは手を生成しない。
+ *
+ * Usage: perft <局面ファイル> [depth] [threads]
+ */
+
+template <class TState>
+uint64_t perft(const TState& state, int depth)
+{
+    if (depth == 0)
+        return 1;
+    if (state.lose())
+        return 0;
+    uint64_t nodes = 0;
+    if (depth == 1) {
+        state.forEachMove([&](const typename TState::NextMove&, const typename TState::NextState&) { nodes++; });
+        return nodes;
+    }
+    state.forEachMove([&](const typename TState::NextMove&, const typename TState::NextState& next) {
+        nodes += perft(next, depth - 1);
+    });
+    return nodes;
+}
+
+struct Divide {
+    std::map<std::string, uint64_t> counts;  //! ルートの手(文字列)ごとの葉の数
+    uint64_t nodes = 0;                      //! 葉の数の合計
+    double seconds = 0;
+};
+
+//! ルートの手ごとにperftする。ルートの手はthreads個のスレッドで分け合う。
+template <class TState>
+Divide divide(const TState& state, int depth, int threads)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<typename TState::NextMove, typename TState::NextState>> children;
+    if (!state.lose()) {
+        state.forEachMove([&](const typename TState::NextMove& m, const typename TState::NextState& next) { children.emplace_back(m, next); });
+    }
+    std::vector<uint64_t> counts(children.size());
+    std::atomic<std::size_t> next_index{0};
+    auto worker = [&] {
+        for (std::size_t i; (i = next_index++) < children.size();) {
+            counts[i] = perft(children[i].second, depth - 1);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : pool) {
+        th.join();
+    }
+
+    Divide ret;
+    ret.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (std::size_t i = 0; i < children.size(); i++) {
+        std::ostringstream os;
+        os << children[i].first;
+        ret.counts[os.str()] = counts[i];
+        ret.nodes += counts[i];
+    }
+    return ret;
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: perft <position-file> [depth] [threads]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int depth = argc >= 3 ? std::stoi(argv[2]) : 2;
+    int threads = argc >= 4 ? std::stoi(argv[3]) : 1;
+    if (depth < 1) {
+        std::cerr << "depth must be at least 1" << std::endl;
+        return 1;
+    }
+
+    // 同じ局面を両方の形式で読むため、一旦文字列にする
+    std::vector<std::string> positions;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        std::ostringstream os;
+        os << s;
+        positions.push_back(os.str());
+    }
+
+    std::cout << "Positions: " << positions.size() << ", depth: " << depth << ", threads: " << threads << '\n';
+    std::cout << "position         fast nodes     fast Mnps      slow nodes     slow Mnps  mismatches\n";
+    uint64_t fast_total = 0, slow_total = 0;
+    double fast_seconds = 0, slow_seconds = 0;
+    int total_mismatches = 0;
+    for (int p = 0; p < int(positions.size()); p++) {
+        QuoridorFast::State fast_state;
+        Quoridor::State slow_state;
+        std::istringstream(positions[p]) >> fast_state;
+        std::istringstream(positions[p]) >> slow_state;
+
+        Divide fast = divide(fast_state, depth, threads);
+        Divide slow = divide(slow_state, depth, threads);
+        fast_total += fast.nodes;
+        slow_total += slow.nodes;
+        fast_seconds += fast.seconds;
+        slow_seconds += slow.seconds;
+
+        std::vector<std::string> mismatches;
+        for (auto& [move, count] : fast.counts) {
+            auto it = slow.counts.find(move);
+            if (it == slow.counts.end() || it->second != count) {
+                mismatches.push_back(move + ": fast " + std::to_string(count) + ", slow " + (it == slow.counts.end() ? std::string("-") : std::to_string(it->second)));
+            }
+        }
+        for (auto& [move, count] : slow.counts) {
+            if (fast.counts.count(move) == 0) {
+                mismatches.push_back(move + ": fast -, slow " + std::to_string(count));
+            }
+        }
+        total_mismatches += int(mismatches.size());
+
+        std::cout << std::setw(8) << p << std::setw(16) << fast.nodes << std::setw(14) << std::fixed << std::setprecision(2) << fast.nodes / fast.seconds / 1e6
+                  << std::setw(16) << slow.nodes << std::setw(14) << slow.nodes / slow.seconds / 1e6 << std::setw(12) << mismatches.size() << '\n';
+        for (auto& m : mismatches) {
+            std::cout << "    " << m << '\n';
+        }
+    }
+    std::cout << "total   " << std::setw(16) << fast_total << std::setw(14) << fast_total / fast_seconds / 1e6
+              << std::setw(16) << slow_total << std::setw(14) << slow_total / slow_seconds / 1e6 << std::setw(12) << total_mismatches << std::endl;
+    return total_mismatches == 0 ? 0 : 1;
+}
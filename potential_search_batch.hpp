@@ -0,0 +1,188 @@
+#pragma once
+#include "quoridor_fast.hpp"
+#include <cstdint>
+#include <cstring>
+
+namespace QuoridorFast
+{
+
+/*!
+ * まとめて計算するpotentialSearchの数。-march=nativeで使えるベクトル命令の幅に合わせてコンパイル時に決める。
+ */
+#if defined(__AVX512F__)
+constexpr int BATCH_LANES = 8;
+#elif defined(__AVX2__)
+constexpr int BATCH_LANES = 4;
+#else
+constexpr int BATCH_LANES = 2;
+#endif
+
+/*!
+ * BATCH_LANES枚のBitBoardを、ワードごとにベクトルのレーンに並べたもの。
+ * 演算はBitBoardの同名の演算をレーンごとに行う。
+ */
+struct BitBoardLanes {
+    using Vec = uint64_t __attribute__((vector_size(8 * BATCH_LANES)));
+
+    Vec data[2];
+
+    static BitBoardLanes zero()
+    {
+        return {{Vec{}, Vec{}}};
+    }
+
+    //! 全てのレーンをbbにする
+    static BitBoardLanes broadcast(const BitBoard& bb)
+    {
+        return {{Vec{} + bb.data[0], Vec{} + bb.data[1]}};
+    }
+
+    /*!
+     * レーンごとに並べたワードから作る。
+     * 要素を1つずつベクトルに書き込むと遅いので、配列に並べてからまとめて読み込む。
+     */
+    static BitBoardLanes load(const uint64_t (&word0)[BATCH_LANES], const uint64_t (&word1)[BATCH_LANES])
+    {
+        BitBoardLanes ret;
+        std::memcpy(&ret.data[0], word0, sizeof(Vec));
+        std::memcpy(&ret.data[1], word1, sizeof(Vec));
+        return ret;
+    }
+
+    BitBoardLanes dshift(int n) const
+    {
+        return {{data[0] << n, data[1] << n}};
+    }
+    BitBoardLanes ushift(int n) const
+    {
+        return {{data[0] >> n, data[1] >> n}};
+    }
+    BitBoardLanes rshift(int n) const
+    {
+        int shift = (n * BitBoard::BIT_PER_COLUMN);
+        return {{data[0] << shift, data[1] << shift | data[0] >> (64 - shift)}};
+    }
+    BitBoardLanes lshift(int n) const
+    {
+        int shift = (n * BitBoard::BIT_PER_COLUMN);
+        return {{data[0] >> shift | data[1] << (64 - shift), data[1] >> shift}};
+    }
+    BitBoardLanes operator&(const BitBoardLanes& bb) const
+    {
+        return {{data[0] & bb.data[0], data[1] & bb.data[1]}};
+    }
+    BitBoardLanes operator|(const BitBoardLanes& bb) const
+    {
+        return {{data[0] | bb.data[0], data[1] | bb.data[1]}};
+    }
+    BitBoardLanes operator^(const BitBoardLanes& bb) const
+    {
+        return {{data[0] ^ bb.data[0], data[1] ^ bb.data[1]}};
+    }
+    BitBoardLanes operator~() const
+    {
+        return {{~data[0], ~data[1]}};
+    }
+    BitBoardLanes paraAdd(const BitBoardLanes& bb) const
+    {
+        return {{data[0] + bb.data[0], data[1] + bb.data[1]}};
+    }
+
+    //! 等しいレーンが全ビット1になるマスク
+    Vec equal(const BitBoardLanes& bb) const
+    {
+        return Vec(data[0] == bb.data[0]) & Vec(data[1] == bb.data[1]);
+    }
+    //! 空でないレーンが全ビット1になるマスク
+    Vec nonEmpty() const
+    {
+        return Vec((data[0] | data[1]) != 0);
+    }
+};
+
+/*!
+ * potentialSearchをBATCH_LANES個まとめて行い、レーンごとのコストを返す。
+ * 兄弟の局面は壁が1枚違うだけなので、全てのレーンが同じくらいの回数で終わることを期待している。
+ * 結果はpotentialSearchと同じで、ゴールに届かなければ-1。unusedが全ビット1のレーンは計算しない。
+ */
+inline BitBoardLanes::Vec potentialSearchLanes(const BitBoardLanes& hfullwall, const BitBoardLanes& vfullwall,
+    const BitBoardLanes& start, const BitBoardLanes& goal, BitBoardLanes::Vec unused = BitBoardLanes::Vec{})
+{
+    using Vec = BitBoardLanes::Vec;
+    const BitBoardLanes not_h = ~hfullwall;
+    const BitBoardLanes not_v = ~vfullwall;
+    const BitBoardLanes not_v_right = ~vfullwall.rshift(1);
+
+    auto pullDown = [&](const BitBoardLanes& p1) {
+        return (~(not_h & p1).paraAdd(not_h) ^ hfullwall) | p1;  // 下に引っ張る(コスト0)
+    };
+    auto addCost = [&](const BitBoardLanes& p1, const BitBoardLanes& p2) {
+        return p1 | (p1.lshift(1) & not_v) | (p1.rshift(1) & not_v_right) | (p2.ushift(1) & not_h);
+    };
+
+    Vec done = unused;
+    Vec result{};
+    Vec current{};
+    const Vec one = Vec{} + 1;
+    const Vec unreachable = ~Vec{};
+
+    BitBoardLanes p0 = pullDown(start);
+    BitBoardLanes p1 = BitBoardLanes::zero();
+    BitBoardLanes p2 = BitBoardLanes::zero();
+
+    auto allDone = [&] {
+        uint64_t all = ~uint64_t(0);
+        for (int i = 0; i < BATCH_LANES; i++) {
+            all &= done[i];
+        }
+        return all != 0;
+    };
+    auto oneRound = [&](const BitBoardLanes& cur, const BitBoardLanes& prev, BitBoardLanes& out) {
+        Vec found = (cur & goal).nonEmpty() & ~done;
+        result |= current & found;
+        done |= found;
+        out = pullDown(addCost(cur, prev));
+        Vec stuck = out.equal(prev) & ~done;
+        result |= unreachable & stuck;
+        done |= stuck;
+        current += one;
+        return allDone();
+    };
+    while (true) {
+        if (oneRound(p0, p1, p2))
+            break;
+        if (oneRound(p2, p0, p1))
+            break;
+        if (oneRound(p1, p2, p0))
+            break;
+    }
+    return result;
+}
+
+/*!
+ * potentialSearchをn(<= BATCH_LANES)個まとめて行い、それぞれのコストをcostに入れる。
+ */
+inline void potentialSearchBatch(const BitBoard* hfullwall, const BitBoard* vfullwall, const BitBoard* start, const BitBoard* goal, int n, int* cost)
+{
+    uint64_t words[4][2][BATCH_LANES] = {};
+    BitBoardLanes::Vec unused{};
+    for (int i = 0; i < BATCH_LANES; i++) {
+        if (i < n) {
+            for (int w = 0; w < 2; w++) {
+                words[0][w][i] = hfullwall[i].data[w];
+                words[1][w][i] = vfullwall[i].data[w];
+                words[2][w][i] = start[i].data[w];
+                words[3][w][i] = goal[i].data[w];
+            }
+        } else {
+            unused[i] = ~uint64_t(0);
+        }
+    }
+    const BitBoardLanes::Vec result = potentialSearchLanes(BitBoardLanes::load(words[0][0], words[0][1]), BitBoardLanes::load(words[1][0], words[1][1]),
+        BitBoardLanes::load(words[2][0], words[2][1]), BitBoardLanes::load(words[3][0], words[3][1]), unused);
+    for (int i = 0; i < n; i++) {
+        cost[i] = int(int64_t(result[i]));
+    }
+}
+
+}  // namespace QuoridorFast
@@ -186,7 +186,7 @@ struct State {
     std::array<std::array<WallState, N - 1>, N - 1> m_walls;
 
 
-    bool operator==(const State& s2)
+    bool operator==(const State& s2) const
     {
         return my_pos == s2.my_pos
                && opponent_pos == s2.opponent_pos
@@ -194,10 +194,31 @@ struct State {
                && opponent_rem_walls == s2.opponent_rem_walls
                && m_walls == s2.m_walls;
     }
-    bool operator!=(const State& s2)
+    bool operator!=(const State& s2) const
     {
         return !(*this == s2);
     }
+
+    //! 置換表用のハッシュ値(FNV-1a)
+    static uint64_t hash(const State& s)
+    {
+        uint64_t h = 14695981039346656037ull;
+        auto add = [&](int x) {
+            h = (h ^ uint64_t(uint32_t(x))) * 1099511628211ull;
+        };
+        add(s.my_pos.x);
+        add(s.my_pos.y);
+        add(s.opponent_pos.x);
+        add(s.opponent_pos.y);
+        add(s.my_rem_walls);
+        add(s.opponent_rem_walls);
+        for (auto& row : s.m_walls) {
+            for (auto w : row) {
+                add(int(w));
+            }
+        }
+        return h;
+    }
     static State initialState()
     {
         return State{{4, 8}, 10, {4, 0}, 10, {}};
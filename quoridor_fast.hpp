@@ -4,6 +4,7 @@
 
 #include <array>
 #include <bitset>
+#include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <functional>
@@ -106,6 +107,11 @@ struct Advance {
     {
         return is >> m.new_position;
     }
+
+    constexpr bool operator==(const Advance& m2) const
+    {
+        return new_position == m2.new_position;
+    }
 };
 
 struct Put {
@@ -126,6 +132,11 @@ struct Put {
         m.direction = (dir == 'H' ? WallDirection::Horizontal : dir == 'V' ? WallDirection::Vertical : throw std::invalid_argument("dir"));
         return is;
     }
+
+    constexpr bool operator==(const Put& m2) const
+    {
+        return direction == m2.direction && pos == m2.pos;
+    }
 };
 
 
@@ -454,6 +465,219 @@ constexpr int potentialSearch(const BitBoard& hfullwall, const BitBoard& vfullwa
     }
 }
 
+/*!
+ * このスレッドで探索中に行ったpotentialSearchの回数。探索の統計に使う。
+ * potentialSearchはconstexprなので、数えるのはpotentialSearchCountedかまとめて探索した側で行う。
+ */
+inline thread_local uint64_t potential_search_count = 0;
+
+//! 回数をpotential_search_countに数えるpotentialSearch
+inline int potentialSearchCounted(const BitBoard& hfullwall, const BitBoard& vfullwall, const BitBoard& start, const BitBoard& goal)
+{
+    potential_search_count++;
+    return potentialSearch(hfullwall, vfullwall, start, goal);
+}
+
+/*!
+ * 駒からゴールまでの最短経路を全て重ねたDAGのうち、壁で塞がれうる辺。
+ * 壁を置くと距離は縮まないので、DAGの辺を1本も塞がない壁を置いても最短経路は残り、距離は変わらない。
+ * 親の局面で一度作っておけば、壁を置いた子の局面の距離がpotentialSearchなしで分かる。
+ */
+struct ShortestPathDag {
+    static constexpr int MAX_LAYERS = 128;
+
+    int dist;          //! 駒からゴールまでの歩数。届かなければ-1
+    BitBoard cut_h;    //! そこに横壁を置くとDAGの辺を塞ぐ位置
+    BitBoard cut_v;    //! そこに縦壁を置くとDAGの辺を塞ぐ位置
+
+    /*!
+     * ゴールからの幅優先探索で層を作り、駒から層を逆にたどってDAGの辺を集める。
+     * 届かないときは、どの壁でも距離が変わりうるものとして全ての位置をcut_h, cut_vに入れる。
+     */
+    static ShortestPathDag build(const BitBoard& hfullwall, const BitBoard& vfullwall, const BitBoard& goal, const BitBoard& pawn)
+    {
+        auto neighbors = [&](const BitBoard& p) {
+            return (p.lshift(1) & ~vfullwall) | (p.rshift(1) & ~vfullwall.rshift(1)) | (p.ushift(1) & ~hfullwall) | (p.dshift(1) & ~hfullwall.dshift(1));
+        };
+
+        // layers[k]はゴールからちょうどk歩のマス
+        BitBoard layers[MAX_LAYERS];
+        layers[0] = goal;
+        BitBoard visited = goal;
+        int k = 0;
+        while ((layers[k] & pawn).empty()) {
+            BitBoard next = neighbors(layers[k]) & ~visited;
+            if (next.empty() || k + 1 == MAX_LAYERS)
+                return {-1, ~BitBoard{}, ~BitBoard{}};
+            layers[++k] = next;
+            visited = visited | next;
+        }
+
+        // 縦の辺(p, p+(0,1))と横の辺(p, p+(1,0))を、それぞれpの位置に集める
+        BitBoard edge_v{}, edge_h{};
+        BitBoard on = pawn;
+        for (int j = k; j > 0; j--) {
+            const BitBoard& prev = layers[j - 1];
+            edge_v = edge_v | (on & prev.ushift(1) & ~hfullwall) | (on.ushift(1) & prev & ~hfullwall);
+            edge_h = edge_h | (on & prev.lshift(1) & ~vfullwall) | (on.lshift(1) & prev & ~vfullwall);
+            on = neighbors(on) & prev;
+        }
+        // 横壁はpとp+(1,0)の下の辺を、縦壁はpとp+(0,1)の右の辺を塞ぐ
+        return {k, edge_v | edge_v.lshift(1), edge_h | edge_h.ushift(1)};
+    }
+
+    //! putを置いても距離が変わらないか
+    constexpr bool unchangedBy(const Put& put) const
+    {
+        return !(put.direction == WallDirection::Horizontal ? cut_h : cut_v)[put.pos];
+    }
+};
+
+
+/*!
+ * 置かれている壁と盤の外周を、マスの角(格子点)をつなぐ線とみなしたときの連結成分。
+ * 新しい壁の両端と中央のどの2点も既につながっていなければ、壁で囲まれた領域は増えず、
+ * どのマスの間の行き来も変わらない。つながっている(領域を閉じる)壁だけ、駒がゴールに届くかを調べればよい。
+ * 格子点はその左上のマスの位置で表す。
+ */
+class WallGraph
+{
+public:
+    constexpr WallGraph(const BitBoard& wall_h, const BitBoard& wall_v)
+        : wall_h(wall_h & possible_wall_place),
+          wall_v(wall_v & possible_wall_place),
+          touched(border_corners | this->wall_h | this->wall_h.lshift(1) | this->wall_h.rshift(1) | this->wall_v | this->wall_v.ushift(1) | this->wall_v.dshift(1))
+    {
+    }
+
+    /*!
+     * dirの向きに置くと領域を閉じるかもしれない位置。両端と中央のうち2点以上が既に壁か外周に触れている。
+     * ここに入らない位置は調べなくても領域を閉じない。
+     */
+    constexpr BitBoard mayCloseRegion(WallDirection dir) const
+    {
+        const BitBoard a = dir == WallDirection::Horizontal ? touched.rshift(1) : touched.dshift(1);
+        const BitBoard c = dir == WallDirection::Horizontal ? touched.lshift(1) : touched.ushift(1);
+        return (a & touched) | (touched & c) | (a & c);
+    }
+
+    //! dirの向きにpへ壁を置くと、壁で囲まれた領域が新しくできるか
+    constexpr bool closesRegion(WallDirection dir, Position p)
+    {
+        if (!built) {
+            build();
+        }
+        const Position d = dir == WallDirection::Horizontal ? Position{1, 0} : Position{0, 1};
+        const int a = parent[corner(p - d)];
+        const int b = parent[corner(p)];
+        const int c = parent[corner(p + d)];
+        return a == b || b == c || a == c;
+    }
+
+private:
+    //! 盤の内側の格子点は(N-1)^2個。外周の格子点は全て1つにまとめる。
+    static constexpr int BORDER = (N - 1) * (N - 1);
+
+    static constexpr BitBoard border_corners = [] {
+        BitBoard ret{};
+        for (int i = -1; i < N; i++) {
+            ret.set({int8_t(i), -1}, true);
+            ret.set({int8_t(i), int8_t(N - 1)}, true);
+            ret.set({-1, int8_t(i)}, true);
+            ret.set({int8_t(N - 1), int8_t(i)}, true);
+        }
+        return ret;
+    }();
+
+    BitBoard wall_h, wall_v;
+    BitBoard touched;  //! 壁か外周に触れている格子点
+    bool built = false;
+    int8_t parent[BORDER + 1] = {};
+
+    static constexpr int corner(Position p)
+    {
+        if (p.x < 0 || p.x >= N - 1 || p.y < 0 || p.y >= N - 1)
+            return BORDER;
+        return p.x * (N - 1) + p.y;
+    }
+    constexpr int find(int i)
+    {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+    constexpr void addWall(WallDirection dir, Position p)
+    {
+        const Position d = dir == WallDirection::Horizontal ? Position{1, 0} : Position{0, 1};
+        const int b = find(corner(p));
+        parent[find(corner(p - d))] = int8_t(b);
+        parent[find(corner(p + d))] = int8_t(b);
+    }
+    //! 連結成分を求め、parentに各格子点の代表を入れる
+    constexpr void build()
+    {
+        for (int i = 0; i <= BORDER; i++) {
+            parent[i] = int8_t(i);
+        }
+        wall_h.forEachBit([&](Position p) { addWall(WallDirection::Horizontal, p); });
+        wall_v.forEachBit([&](Position p) { addWall(WallDirection::Vertical, p); });
+        for (int i = 0; i <= BORDER; i++) {
+            parent[i] = int8_t(find(i));
+        }
+        built = true;
+    }
+};
+
+
+/*!
+ * Zobristハッシュ用の乱数表。インデックスはBitBoard::bitindex。
+ * flipPlayers()したときのキーも差分で更新できるように、上下反転した位置の値も持っておく。
+ */
+struct Zobrist {
+    uint64_t wall[2][128];      //!< [WallDirection][壁の位置]
+    uint64_t wall_flip[2][128]; //!< 上下反転した位置の壁に対応する値
+    uint64_t my_pos[128];
+    uint64_t opponent_pos[128];
+    uint64_t my_rem_walls[16];
+    uint64_t opponent_rem_walls[16];
+
+    static constexpr Zobrist generate()
+    {
+        uint64_t seed = 0x9e3779b97f4a7c15ull;
+        auto next = [&seed] {  // splitmix64
+            uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        };
+        Zobrist z{};
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < 128; i++) {
+                z.wall[d][i] = next();
+            }
+        }
+        for (int i = 0; i < 128; i++) {
+            z.my_pos[i] = next();
+            z.opponent_pos[i] = next();
+        }
+        for (int i = 0; i < 16; i++) {
+            z.my_rem_walls[i] = next();
+            z.opponent_rem_walls[i] = next();
+        }
+        for (int d = 0; d < 2; d++) {
+            for (int y = 0; y < N - 1; y++) {
+                for (int x = 0; x < N; x++) {  // possible_wall_placeは右端の列も含む
+                    z.wall_flip[d][BitBoard::bitindex({int8_t(x), int8_t(y)})] = z.wall[d][BitBoard::bitindex({int8_t(x), int8_t(N - 2 - y)})];
+                }
+            }
+        }
+        return z;
+    }
+};
+constexpr Zobrist zobrist = Zobrist::generate();
+
 
 struct State {
 
@@ -472,6 +696,9 @@ struct State {
     BitBoard wall_h;  // 端には囲うように壁を配置する。
     BitBoard wall_v;
 
+    uint64_t key;       //!< Zobristハッシュ。盤面を変更したら差分更新する。
+    uint64_t flip_key;  //!< flipPlayers()した状態のkey
+
 
     constexpr bool operator==(const State& s2) const
     {
@@ -482,6 +709,82 @@ struct State {
         return !(*this == s2);
     }
 
+    //! 置換表用のハッシュ値
+    static uint64_t hash(const State& s)
+    {
+        assert(s.key == s.computeKey(false) && s.flip_key == s.computeKey(true));
+        return s.key;
+    }
+
+    /*!
+     * keyを最初から計算する。
+     * @param flip trueならflipPlayers()した状態のkeyを計算する
+     */
+    constexpr uint64_t computeKey(bool flip) const
+    {
+        uint64_t k = 0;
+        for (int d = 0; d < 2; d++) {
+            const BitBoard walls = (d == 0 ? wall_h : wall_v) & possible_wall_place;
+            for (int i = 0; i < 2; i++) {
+                uint64_t rem = walls.data[i];
+                while (rem != 0) {
+                    uint32_t bit = __builtin_ctzll(rem);
+                    k ^= (flip ? zobrist.wall_flip : zobrist.wall)[d][bit + i * 64];
+                    rem &= rem - 1;
+                }
+            }
+        }
+        if (flip) {
+            k ^= zobrist.my_pos[BitBoard::bitindex({opponent_pos.x, int8_t(N - 1 - opponent_pos.y)})];
+            k ^= zobrist.opponent_pos[BitBoard::bitindex({my_pos.x, int8_t(N - 1 - my_pos.y)})];
+            k ^= zobrist.my_rem_walls[opponent_rem_walls & 15] ^ zobrist.opponent_rem_walls[my_rem_walls & 15];
+        } else {
+            k ^= zobrist.my_pos[BitBoard::bitindex(my_pos)] ^ zobrist.opponent_pos[BitBoard::bitindex(opponent_pos)];
+            k ^= zobrist.my_rem_walls[my_rem_walls & 15] ^ zobrist.opponent_rem_walls[opponent_rem_walls & 15];
+        }
+        return k;
+    }
+
+    //! 盤面を直接書き換えた後に呼ぶ
+    constexpr void updateKey()
+    {
+        key = computeKey(false);
+        flip_key = computeKey(true);
+    }
+
+    /*!
+     * 壁のビットを反転する(置く・取り除く)。
+     * @param bit BitBoard上のビット番号(BitBoard::bitindex)
+     */
+    constexpr void toggleWall(WallDirection dir, uint32_t bit)
+    {
+        (dir == WallDirection::Horizontal ? wall_h : wall_v).data[bit / 64] ^= 1ull << (bit % 64);
+        key ^= zobrist.wall[int(dir)][bit];
+        flip_key ^= zobrist.wall_flip[int(dir)][bit];
+    }
+
+    constexpr void setOpponentPos(Position p)
+    {
+        key ^= zobrist.opponent_pos[BitBoard::bitindex(opponent_pos)] ^ zobrist.opponent_pos[BitBoard::bitindex(p)];
+        flip_key ^= zobrist.my_pos[BitBoard::bitindex({opponent_pos.x, int8_t(N - 1 - opponent_pos.y)})]
+                    ^ zobrist.my_pos[BitBoard::bitindex({p.x, int8_t(N - 1 - p.y)})];
+        opponent_pos = p;
+    }
+
+    constexpr void setMyRemWalls(int16_t n)
+    {
+        key ^= zobrist.my_rem_walls[my_rem_walls & 15] ^ zobrist.my_rem_walls[n & 15];
+        flip_key ^= zobrist.opponent_rem_walls[my_rem_walls & 15] ^ zobrist.opponent_rem_walls[n & 15];
+        my_rem_walls = n;
+    }
+
+    constexpr void setOpponentRemWalls(int16_t n)
+    {
+        key ^= zobrist.opponent_rem_walls[opponent_rem_walls & 15] ^ zobrist.opponent_rem_walls[n & 15];
+        flip_key ^= zobrist.my_rem_walls[opponent_rem_walls & 15] ^ zobrist.my_rem_walls[n & 15];
+        opponent_rem_walls = n;
+    }
+
     constexpr bool hWall(Position p) const
     {
         return wall_h[p];  // 端には囲うように壁を配置する。境界チェックしていないことに注意。
@@ -498,7 +801,9 @@ struct State {
             .my_rem_walls = opponent_rem_walls,
             .opponent_rem_walls = my_rem_walls,
             .wall_h = flipWalls(wall_h),
-            .wall_v = flipWalls(wall_v)};
+            .wall_v = flipWalls(wall_v),
+            .key = flip_key,
+            .flip_key = key};
     }
 
     constexpr BitBoard hFullWall() const
@@ -542,7 +847,9 @@ struct State {
          *
          */
 
-        return State{{4, 8}, {4, 0}, 10, 10, initial_horizontal, initial_vertical};
+        State s{{4, 8}, {4, 0}, 10, 10, initial_horizontal, initial_vertical, 0, 0};
+        s.updateKey();
+        return s;
         //            //@formatter:off
         //            // clang-format off
         //                {/*0123456789abcd 0123456789 0123456789 0123456789 0123456789 0123456789*/
@@ -603,7 +910,7 @@ struct State {
                                                                && ((rotd == Position{1, 1} && !hasWall(opponent_pos, (MoveDirection)((i - 1) & 3)))
                                                                       || (rotd == Position{1, -1} && !hasWall(opponent_pos, (MoveDirection)((i + 1) & 3)))))))) {
                                           State flipped = flipPlayers();
-                                          flipped.opponent_pos = Position{m.new_position.x, int8_t(N - 1 - m.new_position.y)};
+                                          flipped.setOpponentPos(Position{m.new_position.x, int8_t(N - 1 - m.new_position.y)});
                                           return flipped;
                                       }
                                   }
@@ -620,12 +927,8 @@ struct State {
                                   }
 
                                   State copy = *this;
-                                  if (m.direction == WallDirection::Horizontal) {
-                                      copy.wall_h.set(m.pos, true);
-                                  } else {
-                                      copy.wall_v.set(m.pos, true);
-                                  }
-                                  copy.my_rem_walls--;
+                                  copy.toggleWall(m.direction, BitBoard::bitindex(m.pos));
+                                  copy.setMyRemWalls(copy.my_rem_walls - 1);
                                   // 自分や相手が動けなくなるような置き方をしてはいけない
                                   if (potentialSearch(copy.hFullWall(), copy.vFullWall(), my_goal, BitBoard::oneHot(copy.my_pos)) == -1) {
                                       return std::nullopt;
@@ -639,6 +942,30 @@ struct State {
     }
 
 
+    /*!
+     * negascoutで手を並べるための、壁を置く手の安い見積もり(小さいほど良さそう)。
+     * 駒の移動はstd::nulloptを返し、評価関数で並べてもらう。
+     * 相手の駒に近く、相手の進む方向(yが大きい方)にある壁ほど相手の邪魔になりやすいとみなす。
+     */
+    constexpr std::optional<int> cheapMoveScore(const NextMove& m) const
+    {
+        const Put* put = std::get_if<Put>(&m);
+        if (put == nullptr)
+            return std::nullopt;
+        int dx = 2 * put->pos.x + 1 - 2 * opponent_pos.x;
+        int dy = 2 * put->pos.y + 1 - 2 * opponent_pos.y;  // 正なら相手の前
+        return (dx < 0 ? -dx : dx) + (dy > 0 ? dy : -3 * dy) + (put->direction == WallDirection::Vertical ? 1 : 0);
+    }
+
+    //! history heuristic用に、手を[0, MOVE_KEY_SIZE)に対応させる。壁は向きと位置、駒の移動は行き先で区別する。
+    static constexpr int MOVE_KEY_SIZE = 3 * 128;
+    static constexpr int moveKey(const NextMove& m)
+    {
+        if (const Put* put = std::get_if<Put>(&m))
+            return int(put->direction) * 128 + int(BitBoard::bitindex(put->pos));
+        return 2 * 128 + int(BitBoard::bitindex(std::get<Advance>(m).new_position));
+    }
+
     struct PrettyFormat;
     PrettyFormat pretty(bool flip = false) const;
 
@@ -661,7 +988,7 @@ struct State {
                 auto call = [&](Position diff) {
                     Position newp = my_pos + rotate(diff, i);
                     NextMove m = Advance{newp};
-                    flipped.opponent_pos = Position{newp.x, int8_t(N - 1 - newp.y)};
+                    flipped.setOpponentPos(Position{newp.x, int8_t(N - 1 - newp.y)});
                     func(m, flipped);
                 };
 
@@ -689,9 +1016,9 @@ struct State {
             }
         }
 
-        flipped.opponent_pos = Position{my_pos.x, int8_t(N - 1 - my_pos.y)};
+        flipped.setOpponentPos(Position{my_pos.x, int8_t(N - 1 - my_pos.y)});
         if (my_rem_walls > 0) {
-            flipped.opponent_rem_walls--;
+            flipped.setOpponentRemWalls(flipped.opponent_rem_walls - 1);
             auto call = [&func](WallDirection dir, Position p, const State& bb) {
                 NextMove m = Put{dir, p};
 #ifndef NDEBUG
@@ -712,19 +1039,45 @@ struct State {
                 }
             };
             BitBoard h_possible = possible_wall_place & ~flipped.wall_h & ~flipped.wall_h.rshift(1) & ~flipped.wall_h.lshift(1) & ~flipped.wall_v;
+            BitBoard v_possible = possible_wall_place & ~flipped.wall_v & ~flipped.wall_v.dshift(1) & ~flipped.wall_v.ushift(1) & ~flipped.wall_h;
+
+            // 壁で囲まれた領域を新しく作り、しかも駒の最短経路を塞ぐ壁だけ、置いた後にゴールに届くか調べる。
+            // 届かなければ候補から外す。
+            WallGraph graph(flipped.wall_h, flipped.wall_v);
+            const BitBoard flipped_h = flipped.hFullWall();
+            const BitBoard flipped_v = flipped.vFullWall();
+            std::optional<ShortestPathDag> dags[2];
+            auto removeIllegal = [&](WallDirection dir, BitBoard& possible) {
+                for_each_bit(possible & graph.mayCloseRegion(dir), [&](Position p, int i, uint32_t bit) {
+                    if (!graph.closesRegion(dir, p))
+                        return;
+                    if (!dags[0]) {
+                        dags[0] = ShortestPathDag::build(flipped_h, flipped_v, my_goal, BitBoard::oneHot(flipped.my_pos));
+                        dags[1] = ShortestPathDag::build(flipped_h, flipped_v, opponent_goal, BitBoard::oneHot(flipped.opponent_pos));
+                    }
+                    const Put put{dir, p};
+                    const BitBoard wall = BitBoard::oneHot(p);
+                    const BitBoard h = dir == WallDirection::Horizontal ? flipped_h | wall | wall.rshift(1) : flipped_h;
+                    const BitBoard v = dir == WallDirection::Vertical ? flipped_v | wall | wall.dshift(1) : flipped_v;
+                    if ((!dags[0]->unchangedBy(put) && potentialSearchCounted(h, v, my_goal, BitBoard::oneHot(flipped.my_pos)) == -1)
+                        || (!dags[1]->unchangedBy(put) && potentialSearchCounted(h, v, BitBoard::oneHot(flipped.opponent_pos), opponent_goal) == -1)) {
+                        possible.data[i] &= ~(1ull << bit);
+                    }
+                });
+            };
+            removeIllegal(WallDirection::Horizontal, h_possible);
+            removeIllegal(WallDirection::Vertical, v_possible);
 
             for_each_bit(h_possible, [&](Position p, int i, uint32_t bit) {
-                flipped.wall_h.data[i] |= (1ull << bit);
+                flipped.toggleWall(WallDirection::Horizontal, bit + i * 64);
                 call(WallDirection::Horizontal, {p.x, int8_t(N - 2 - p.y)}, flipped);
-                flipped.wall_h.data[i] &= ~(1ull << bit);
+                flipped.toggleWall(WallDirection::Horizontal, bit + i * 64);
             });
 
-            BitBoard v_possible = possible_wall_place & ~flipped.wall_v & ~flipped.wall_v.dshift(1) & ~flipped.wall_v.ushift(1) & ~flipped.wall_h;
-
             for_each_bit(v_possible, [&](Position p, int i, uint32_t bit) {
-                flipped.wall_v.data[i] |= (1ull << bit);
+                flipped.toggleWall(WallDirection::Vertical, bit + i * 64);
                 call(WallDirection::Vertical, {p.x, int8_t(N - 2 - p.y)}, flipped);
-                flipped.wall_v.data[i] &= ~(1ull << bit);
+                flipped.toggleWall(WallDirection::Vertical, bit + i * 64);
             });
         }
     }
@@ -824,17 +1177,9 @@ std::istream& operator>>(std::istream& is, State& s)
             }
         }
     }
+    if (is)  // 読み込みに失敗したときは座標が範囲外のことがある
+        s.updateKey();
     return is;
 }
-template <class T, class SFINAE = std::enable_if_t<sizeof(State) % sizeof(uint64_t) == 0>>
-static constexpr uint32_t hash(const T& s)
-{
-    const uint64_t* ptr = reinterpret_cast<const uint64_t*>(&s);
-    uint64_t temp = 0;
-    for (int i = 0; i < int(sizeof(State) / sizeof(uint64_t)); i++) {
-        temp ^= ptr[i];
-    }
-    return uint32_t(temp) ^ uint32_t(temp >> 32);
-}
 
 }  // namespace QuoridorFast
@@ -0,0 +1,73 @@
+#include "evaluator.hpp"
+#include "negaalpha.hpp"
+#include "parallel_negascout.hpp"
+#include "quoridor_fast.hpp"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/*!
+ * YBWによる並列negascoutのスレッド数ごとの速度向上を測る。
+ * 局面ファイルの各局面を置換表を空にしてから深さdepthまで反復深化で探索し、合計時間を1スレッドと比べる。
+ *
+ * Usage: speedup <局面ファイル> [depth] [max_threads]
+ */
+int main(int argc, const char** argv)
+{
+    if (argc < 2 || argc > 4) {
+        std::cerr << "Usage: speedup <position-file> [depth] [max_threads]" << std::endl;
+        return 1;
+    }
+    std::ifstream in(argv[1]);
+    int depth = argc >= 3 ? std::stoi(argv[2]) : 5;
+    int max_threads = argc >= 4 ? std::stoi(argv[3]) : int(std::thread::hardware_concurrency());
+
+    std::vector<QuoridorFast::State> positions;
+    while (true) {
+        QuoridorFast::State s;
+        in >> s;
+        if (!in)
+            break;
+        positions.push_back(s);
+    }
+
+    std::vector<int> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(std::max(1, max_threads));
+
+    const QuoridorFast::Evaluate eval;
+
+    std::cout << "Positions: " << positions.size() << ", depth: " << depth << '\n';
+    std::cout << "threads      time[ms]   speedup  mismatches\n";
+    double base_ms = 0;
+    std::vector<TScore> base_scores;
+    for (int threads : thread_counts) {
+        SplitSearch<QuoridorFast::State> search(threads);
+        double total_ms = 0;
+        int mismatches = 0;
+        for (int p = 0; p < int(positions.size()); p++) {
+            hash_table<QuoridorFast::State>.clear();
+            auto start = std::chrono::steady_clock::now();
+            Result<QuoridorFast::State> res = {};
+            for (int i = 1; i <= depth; i++) {
+                res = iterativeDeepeningParallelNegascout(search, positions[p], eval, i, i - 1, [] { return false; });
+            }
+            total_ms += (std::chrono::steady_clock::now() - start).count() / 1.0e6;
+            if (threads == 1) {
+                base_scores.push_back(res.score);
+            } else if (base_scores[p] != res.score) {
+                mismatches++;
+            }
+        }
+        if (threads == 1)
+            base_ms = total_ms;
+        std::cout << std::setw(7) << threads << std::setw(14) << std::fixed << std::setprecision(1) << total_ms
+                  << std::setw(10) << std::setprecision(2) << base_ms / total_ms << std::setw(12) << mismatches << std::endl;
+    }
+    return 0;
+}
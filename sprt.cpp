@@ -0,0 +1,331 @@
+#include "engine_process.hpp"
+#include "engine_protocol.hpp"
+#include "match_utils.hpp"
+#include "quoridor_fast.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * 2つのエンジンを対局させ、逐次確率比検定(SPRT)でAがBより強いかを調べる。
+ * エンジンはjudgeと同じく、標準入力に局面を受け取り、標準出力に手を1行で返す子プロセスとして動かす。
+ * --binaryなら、エンジンとはEngineProtocolで、最初の局面と相手の手だけをやり取りする(negascout-fast --binary用)。
+ * 開始局面は初期局面からランダムな手をopening-plies手進めたもので、同じ開始局面を先手を入れ替えて2局(1組)指す。
+ * 対局はconcurrency組ずつ並列に行い、1組終わるたびに対数尤度比(LLR)を計算して、境界を越えたら対局中の組を打ち切って終わる。
+ * LLRは1組の得点(0, 0.5, 1, 1.5, 2の5通り)の平均と分散から正規近似で求める(GSPRT)。Eloの差はロジスティックのもの。
+ * 反則の手、手を返さない(move-timeoutを過ぎた、終了した)エンジンは負け。max-pliesで決着がつかなければ引き分け。
+ *
+ * Usage: sprt [オプション] <エンジンAのコマンド> <エンジンBのコマンド>
+ *   --elo0 E, --elo1 E  帰無仮説と対立仮説のEloの差(既定は0と5)
+ *   --alpha A, --beta B 第1種と第2種の過誤の確率(既定はどちらも0.05)
+ *   --concurrency N     同時に指す組の数(既定はコア数)
+ *   --max-games N       検定がつかなくてもこの局数で止める(既定は20000)
+ *   --opening-plies N, --max-plies N, --seed S, --move-timeout MS(既定は10000), --engine-stderr, --binary
+ * コマンドは/bin/shで実行するので、引数もつけられる。例: "./negascout-fast --movetime 100"
+ * 終了コードは、H1(Aがelo1だけ強い)が採択されたら0、H0が採択されたら2、決まらなければ3。
+ */
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+using Match::Outcome;
+
+//! LLRの正規近似は組が少ないと当てにならないので、この組数までは境界を越えても止めない
+constexpr uint64_t MIN_PAIRS = 10;
+
+struct Settings {
+    std::array<std::string, 2> commands;  //! エンジンA, Bのコマンド
+    int max_plies = 200;
+    int64_t move_timeout = 10000;
+    bool show_stderr = false;
+    bool binary = false;  //! エンジンとEngineProtocolでやり取りする
+};
+
+/*!
+ * sからエンジンfirstを先手、secondを後手にして対局する。
+ * 手を返さない、読めない手や反則の手を返したエンジンは負けで、理由をerrorに入れる。abortがtrueを返したらstd::nullopt。
+ */
+template <class F>
+std::optional<Outcome> playGame(const Settings& settings, int first, QuoridorFast::State s, std::string& error, const F& abort)
+{
+    std::array<EngineProcess, 2> engines{
+        EngineProcess{settings.commands[first], settings.show_stderr},
+        EngineProcess{settings.commands[1 - first], settings.show_stderr}};
+    uint8_t last_move = EngineProtocol::NO_MOVE;  //! --binaryで、直前に指された手
+    for (int ply = 0; ply < settings.max_plies; ply++) {
+        const int turn = ply % 2;
+        const Outcome loss = turn == 0 ? Outcome::SecondWins : Outcome::FirstWins;
+        auto& engine = engines[turn];
+        const auto deadline = Clock::now() + std::chrono::milliseconds(settings.move_timeout);
+        QuoridorFast::State::NextMove m;
+        std::string shown;  //! エラーで出す、エンジンが返した手
+        if (settings.binary) {
+            // 最初の手番は局面を、その後は相手の手だけを送る
+            std::string message;
+            if (ply < 2) {
+                const auto data = EngineProtocol::encodeState(s);
+                message = 'P' + std::string(data.begin(), data.end());
+            } else {
+                message = {'M', char(last_move)};
+            }
+            if (!engine.running() || !engine.send(message)) {
+                error = "cannot start or write to the engine";
+                return loss;
+            }
+            const auto reply = engine.receiveBytes(2, deadline, abort);
+            if (abort())
+                return std::nullopt;
+            if (!reply) {
+                error = "no move (timed out or exited)";
+                return loss;
+            }
+            shown = std::to_string(int(uint8_t((*reply)[1])));
+            const auto decoded = (*reply)[0] == 'M' ? EngineProtocol::decodeMove(uint8_t((*reply)[1])) : std::nullopt;
+            if (!decoded) {
+                error = "unreadable reply: " + std::string(1, (*reply)[0]) + ' ' + shown;
+                return loss;
+            }
+            m = *decoded;
+            last_move = uint8_t((*reply)[1]);
+        } else {
+            std::ostringstream state;
+            state << s << '\n';
+            if (!engine.running() || !engine.send(state.str())) {
+                error = "cannot start or write to the engine";
+                return loss;
+            }
+            const auto line = engine.receiveLine(deadline, abort);
+            if (abort())
+                return std::nullopt;
+            if (!line) {
+                error = "no move (timed out or exited)";
+                return loss;
+            }
+            shown = *line;
+            std::istringstream ss{*line};
+            ss.exceptions(std::ios_base::failbit);
+            try {
+                ss >> m;
+            } catch (std::exception&) {
+                error = "unreadable move: " + *line;
+                return loss;
+            }
+        }
+        auto next = s.move(m);
+        if (!next) {
+            error = "illegal move: " + shown;
+            return loss;
+        }
+        s = *next;
+        // sは次に指す側から見た局面なので、lose()なら今指した側の勝ち
+        if (s.lose())
+            return turn == 0 ? Outcome::FirstWins : Outcome::SecondWins;
+    }
+    return Outcome::Draw;
+}
+
+/*!
+ * 1組の結果の分布。pairs[k]はAの2局の得点の合計がk/2だった組の数。
+ */
+struct Pentanomial {
+    std::array<uint64_t, 5> pairs{};
+
+    uint64_t count() const
+    {
+        uint64_t n = 0;
+        for (auto c : pairs)
+            n += c;
+        return n;
+    }
+
+    /*!
+     * 1組の得点を[0, 1]にしたものの平均と分散。
+     * 分布が偏っていても分散が0にならないように、数が0の欄は小さな数として扱う。
+     */
+    std::pair<double, double> meanAndVariance() const
+    {
+        std::array<double, 5> weights;
+        double n = 0;
+        for (int k = 0; k < 5; k++) {
+            weights[k] = pairs[k] == 0 ? 1e-3 : double(pairs[k]);
+            n += weights[k];
+        }
+        double mean = 0, square = 0;
+        for (int k = 0; k < 5; k++) {
+            const double x = k / 4.0;
+            mean += weights[k] * x / n;
+            square += weights[k] * x * x / n;
+        }
+        return {mean, std::max(square - mean * mean, 1e-12)};
+    }
+
+    //! Eloの差がelo0である仮説に対する、elo1である仮説の対数尤度比
+    double llr(double elo0, double elo1) const
+    {
+        if (count() == 0)
+            return 0;
+        const auto [mean, variance] = meanAndVariance();
+        const double s0 = Match::scoreFromElo(elo0), s1 = Match::scoreFromElo(elo1);
+        return double(count()) * (s1 - s0) * (2 * mean - s0 - s1) / (2 * variance);
+    }
+};
+}  // namespace
+
+int main(int argc, const char** argv)
+{
+    double elo0 = 0, elo1 = 5, alpha = 0.05, beta = 0.05;
+    int concurrency = std::max(1u, std::thread::hardware_concurrency());
+    int max_games = 20000;
+    int opening_plies = 4;
+    uint64_t seed = 1;
+    Settings settings;
+    std::vector<std::string> commands;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--elo0" && i + 1 < argc) {
+            elo0 = std::stod(argv[++i]);
+        } else if (arg == "--elo1" && i + 1 < argc) {
+            elo1 = std::stod(argv[++i]);
+        } else if (arg == "--alpha" && i + 1 < argc) {
+            alpha = std::stod(argv[++i]);
+        } else if (arg == "--beta" && i + 1 < argc) {
+            beta = std::stod(argv[++i]);
+        } else if (arg == "--concurrency" && i + 1 < argc) {
+            concurrency = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--max-games" && i + 1 < argc) {
+            max_games = std::max(2, std::stoi(argv[++i]));
+        } else if (arg == "--opening-plies" && i + 1 < argc) {
+            opening_plies = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--max-plies" && i + 1 < argc) {
+            settings.max_plies = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (arg == "--move-timeout" && i + 1 < argc) {
+            settings.move_timeout = std::max<int64_t>(1, std::stoll(argv[++i]));
+        } else if (arg == "--engine-stderr") {
+            settings.show_stderr = true;
+        } else if (arg == "--binary") {
+            settings.binary = true;
+        } else if (arg.rfind("--", 0) != 0) {
+            commands.push_back(arg);
+        } else {
+            commands.clear();
+            break;
+        }
+    }
+    if (commands.size() != 2 || !(elo0 < elo1) || !(alpha > 0 && alpha < 1) || !(beta > 0 && beta < 1)) {
+        std::cerr << "Usage: sprt [--elo0 E] [--elo1 E] [--alpha A] [--beta B] [--concurrency N] [--max-games N]\n"
+                     "            [--opening-plies N] [--max-plies N] [--seed S] [--move-timeout MS] [--engine-stderr] [--binary] <engine A command> <engine B command>\n"
+                     "  elo0 must be less than elo1, and alpha and beta must be in (0, 1)"
+                  << std::endl;
+        return 1;
+    }
+    settings.commands = {commands[0], commands[1]};
+    std::signal(SIGPIPE, SIG_IGN);  // 終了したエンジンに書き込んでも落ちないようにする
+
+    const double lower = std::log(beta / (1 - alpha)), upper = std::log((1 - beta) / alpha);
+    const int max_pairs = (max_games + 1) / 2;
+    std::cout << "A: " << settings.commands[0] << "\nB: " << settings.commands[1] << '\n'
+              << "SPRT: elo0 " << elo0 << ", elo1 " << elo1 << ", alpha " << alpha << ", beta " << beta
+              << std::fixed << std::setprecision(2) << ", bounds (" << lower << ", " << upper << ")\n"
+              << "Concurrency: " << concurrency << ", max games: " << 2 * max_pairs << ", opening plies: " << opening_plies
+              << ", max plies: " << settings.max_plies << ", seed: " << seed << std::endl;
+
+    std::mutex mutex;
+    Pentanomial pentanomial;
+    int wins = 0, losses = 0, draws = 0, forfeits[2] = {};  // Aから見た結果と、A, Bが反則などで負けた数
+    double llr = 0;
+    std::atomic<bool> finished{false};
+    std::atomic<int> next_pair{0};
+    const auto start = Clock::now();
+    auto abort = [&] { return finished.load(std::memory_order_relaxed); };
+
+    auto worker = [&] {
+        for (int p; !abort() && (p = next_pair++) < max_pairs;) {
+            const QuoridorFast::State opening = Match::randomOpening(Match::openingSeed(seed, uint64_t(p)), opening_plies);
+            int points = 0;  // Aの2局の得点の合計を2倍したもの
+            int pair_wins = 0, pair_losses = 0, pair_draws = 0, pair_forfeits[2] = {};
+            bool complete = true;
+            for (int a_first = 1; a_first >= 0 && complete; a_first--) {
+                const int first = a_first ? 0 : 1;
+                std::string error;
+                const auto outcome = playGame(settings, first, opening, error, abort);
+                if (!outcome) {
+                    complete = false;
+                    break;
+                }
+                if (!error.empty()) {
+                    const int loser = (*outcome == Outcome::FirstWins) == (first == 0) ? 1 : 0;
+                    pair_forfeits[loser]++;
+                    std::lock_guard lock{mutex};
+                    std::cerr << "pair " << p << ": engine " << (loser == 0 ? 'A' : 'B') << " loses: " << error << std::endl;
+                }
+                if (*outcome == Outcome::Draw) {
+                    points += 1, pair_draws++;
+                } else if ((*outcome == Outcome::FirstWins) == (first == 0)) {
+                    points += 2, pair_wins++;
+                } else {
+                    pair_losses++;
+                }
+            }
+            // 打ち切った組は数えない
+            if (!complete)
+                break;
+
+            std::lock_guard lock{mutex};
+            if (finished)
+                break;
+            pentanomial.pairs[points]++;
+            wins += pair_wins, losses += pair_losses, draws += pair_draws;
+            forfeits[0] += pair_forfeits[0], forfeits[1] += pair_forfeits[1];
+            llr = pentanomial.llr(elo0, elo1);
+            std::cerr << "  " << wins + losses + draws << " games: +" << wins << " -" << losses << " =" << draws
+                      << ", LLR " << std::fixed << std::setprecision(2) << llr << " (" << lower << ", " << upper << ")" << std::endl;
+            if (((llr <= lower || llr >= upper) && pentanomial.count() >= MIN_PAIRS) || int(pentanomial.count()) >= max_pairs)
+                finished = true;
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < concurrency; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : pool) {
+        th.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    const uint64_t pairs = pentanomial.count();
+    const bool decided = (llr <= lower || llr >= upper) && pairs >= MIN_PAIRS;
+    std::cout << std::fixed << std::setprecision(2)
+              << "Games: " << wins + losses + draws << ", A wins " << wins << ", B wins " << losses << ", draws " << draws
+              << ", forfeits A " << forfeits[0] << " B " << forfeits[1] << '\n'
+              << "Pairs (0, 0.5, 1, 1.5, 2):";
+    for (auto c : pentanomial.pairs) {
+        std::cout << ' ' << c;
+    }
+    std::cout << '\n';
+    if (pairs > 0) {
+        // 1組の得点の平均と標準誤差から、Eloの差と95%の信頼区間を出す
+        const auto [mean, variance] = pentanomial.meanAndVariance();
+        const double error = 1.96 * std::sqrt(variance / double(pairs));
+        std::cout << std::setprecision(1) << "Elo difference: " << Match::eloFromScore(mean)
+                  << " (95%: " << Match::eloFromScore(mean - error) << " .. " << Match::eloFromScore(mean + error) << ")\n";
+    }
+    std::cout << std::setprecision(2) << "LLR: " << llr << " (" << lower << ", " << upper << ")\n"
+              << "Result: " << (!decided ? "inconclusive" : llr >= upper ? "H1 accepted" : "H0 accepted")
+              << "\nTime: " << std::setprecision(1) << seconds << " s" << std::endl;
+    return !decided ? 3 : llr >= upper ? 0 : 2;
+}
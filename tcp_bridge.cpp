@@ -0,0 +1,362 @@
+#include "engine_process.hpp"
+#include "quoridor.hpp"
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+namespace asio = boost::asio;
+using asio::ip::tcp;
+
+/*!
+ * tcp-pipeの代わりに、1つのプロセスで対局サーバーへの接続をいくつも同時に持ち、エンジンのプールに手番を割り振る。
+ * 接続ごとに、最初に受け取る値で後手かどうかを知り、後手なら局面と手の座標をここで反転する(tcp-pipeと同じ)。
+ * エンジンはjudgeと同じテキストのプロトコルで話す子プロセスで、最後まで同じものを使い続ける。
+ * 手番が来た接続には、前の手番に使ったエンジンが空いていればそれを、なければ空いているエンジンを使い、全て使用中なら空くまで待たせる。
+ * 接続が閉じたら対局の終わりとして、まだgames局に達していなければ新しく接続する。
+ * move-timeout以内に手を返さないか、読み書きできなくなったエンジンは終了させてプールから外し、その手番の接続も閉じる。
+ * 他の接続は残りのエンジンで続け、エンジンが1つも残らなければ終わる。
+ * 全て1つのスレッドの上でBoost.Asioで非同期に行う。
+ *
+ * Usage: tcp-bridge <サーバーのアドレス> <エンジンのコマンド> [--port P] [--connections K] [--games N] [--engines E] [--move-timeout MS] [--engine-stderr]
+ * 例: tcp-bridge 127.0.0.1 "./negascout-fast --movetime 500" --connections 16 --games 64 --engines 4
+ * エンジンは手番ごとに別の対局の局面を受け取ることがあるので、--ponderはつけない方がよい。
+ */
+
+namespace
+{
+using Quoridor::N;
+
+//! 局面の数の個数(駒の座標4つ、残りの壁2つ、壁の置き場所8x8)
+constexpr std::size_t STATE_TOKENS = 6 + (N - 1) * (N - 1);
+
+//! エンジンが返した手を、サーバーに送る形にする。flippedなら後手なので座標を先手から見たものにする
+std::string toServerMove(const Quoridor::State::NextMove& m, bool flipped)
+{
+    std::ostringstream os;
+    std::visit(Quoridor::overloaded{
+                   [&](const Quoridor::Advance& a) {
+                       const int x = a.new_position.x, y = a.new_position.y;
+                       os << (flipped ? N - 1 - x : x) << ' ' << (flipped ? N - 1 - y : y);
+                   },
+                   [&](const Quoridor::Put& p) {
+                       const int x = p.pos.x, y = p.pos.y;
+                       os << (flipped ? N - 2 - x : x) << ' ' << (flipped ? N - 2 - y : y) << ' ' << "HV"[int(p.direction)];
+                   }},
+        m);
+    return os.str();
+}
+
+class Bridge
+{
+public:
+    struct Settings {
+        std::string host;
+        std::string port = "8080";
+        std::string engine_command;
+        int connections = 1;
+        int games = 1;
+        int engines = 1;
+        int64_t move_timeout = 10000;  //! エンジンが手を返すまで待つ時間[ms]
+        bool show_stderr = false;
+    };
+
+    Bridge(asio::io_context& io, const Settings& settings) : io(io), settings(settings), resolver(io)
+    {
+        for (int e = 0; e < settings.engines; e++) {
+            engines.push_back(std::make_unique<Engine>(io, settings.engine_command, settings.show_stderr));
+        }
+    }
+
+    //! エンジンが全て起動していれば接続を始めてtrueを返す
+    bool start()
+    {
+        for (auto& engine : engines) {
+            if (!engine->process->running())
+                return false;
+        }
+        for (int c = 0; c < std::min(settings.connections, settings.games); c++) {
+            connect();
+        }
+        return true;
+    }
+
+    int failures() const
+    {
+        return failed;
+    }
+
+private:
+    struct Engine {
+        std::optional<EngineProcess> process;  //! 外したエンジンはresetして終了させる
+        asio::posix::stream_descriptor input;
+        asio::posix::stream_descriptor output;
+        asio::streambuf buffer;
+        asio::steady_timer timer;  //! 手を待つ期限
+        uint64_t turns = 0;        //! 割り振った手番の数。期限の通知が今の手番のものか調べるのに使う
+        bool busy = false;
+        bool dead = false;  //! プールから外した
+
+        // fdはprocessが閉じるので、複製したものを渡す
+        Engine(asio::io_context& io, const std::string& command, bool show_stderr)
+            : process(std::in_place, command, show_stderr),
+              input(io, process->running() ? dup(process->inputFd()) : -1),
+              output(io, process->running() ? dup(process->outputFd()) : -1),
+              timer(io)
+        {
+        }
+    };
+
+    //! サーバーとの1つの接続、つまり1局
+    struct Game {
+        tcp::socket socket;
+        int id;
+        std::optional<bool> flipped;  //! 後手ならtrue。最初に受け取る
+        std::string received;          //! 受け取ったが、まだ数として読んでいない文字
+        std::vector<std::string> tokens;
+        std::array<char, 1024> chunk;
+        int engine = -1;  //! 前の手番に使ったエンジン
+        int plies = 0;    //! 指した手の数
+
+        Game(asio::io_context& io, int id) : socket(io), id(id) {}
+    };
+    using GamePtr = std::shared_ptr<Game>;
+
+    void log(const GamePtr& game, const std::string& text)
+    {
+        std::cerr << "[" << game->id << "] " << text << std::endl;
+    }
+
+    void connect()
+    {
+        if (started >= settings.games)
+            return;
+        auto game = std::make_shared<Game>(io, started++);
+        resolver.async_resolve(settings.host, settings.port, [this, game](const boost::system::error_code& ec, tcp::resolver::results_type endpoints) {
+            if (ec)
+                return finish(game, "resolve: " + ec.message());
+            asio::async_connect(game->socket, endpoints, [this, game](const boost::system::error_code& ec, const tcp::endpoint&) {
+                if (ec)
+                    return finish(game, "connect: " + ec.message());
+                game->socket.set_option(tcp::no_delay(true));
+                readState(game);
+            });
+        });
+    }
+
+    /*!
+     * 空白で区切られた数を、後手かどうかと局面の分だけ読んだら局面をenqueueする。
+     * 数の後に空白が来るまでは、その数は読み終わっていないものとする。
+     */
+    void readState(const GamePtr& game)
+    {
+        std::size_t begin = 0;
+        for (std::size_t i = 0; i < game->received.size(); i++) {
+            if (std::isspace(static_cast<unsigned char>(game->received[i]))) {
+                if (i > begin)
+                    game->tokens.push_back(game->received.substr(begin, i - begin));
+                begin = i + 1;
+            }
+        }
+        game->received.erase(0, begin);
+        if (!game->flipped && !game->tokens.empty()) {
+            game->flipped = game->tokens.front() == "1";
+            game->tokens.erase(game->tokens.begin());
+            log(game, std::string("connected as ") + (*game->flipped ? "PLAYER 2" : "PLAYER 1"));
+        }
+        if (game->flipped && game->tokens.size() >= STATE_TOKENS) {
+            std::ostringstream text;
+            for (std::size_t i = 0; i < STATE_TOKENS; i++) {
+                text << game->tokens[i] << ' ';
+            }
+            game->tokens.erase(game->tokens.begin(), game->tokens.begin() + STATE_TOKENS);
+            Quoridor::State state{};
+            std::istringstream in(text.str());
+            in >> state;
+            if (!in)
+                return finish(game, "unreadable state: " + text.str());
+            queue.push_back({game, *game->flipped ? state.flipPlayers() : state});
+            dispatch();
+            return;
+        }
+        game->socket.async_read_some(asio::buffer(game->chunk), [this, game](const boost::system::error_code& ec, std::size_t size) {
+            if (ec)
+                return finish(game, ec == asio::error::eof ? std::string("closed by the server") : ec.message());
+            game->received.append(game->chunk.data(), size);
+            readState(game);
+        });
+    }
+
+    //! 待っている手番を、空いているエンジンに割り振る
+    void dispatch()
+    {
+        while (!queue.empty()) {
+            auto [game, state] = queue.front();
+            int chosen = -1;
+            if (game->engine >= 0 && !engines[game->engine]->busy) {
+                chosen = game->engine;
+            } else {
+                for (int e = 0; e < int(engines.size()); e++) {
+                    if (!engines[e]->busy) {
+                        chosen = e;
+                        break;
+                    }
+                }
+            }
+            if (chosen < 0)
+                return;
+            queue.pop_front();
+            think(chosen, game, state);
+        }
+    }
+
+    void think(int index, const GamePtr& game, const Quoridor::State& state)
+    {
+        auto& engine = *engines[index];
+        engine.busy = true;
+        game->engine = index;
+        const uint64_t turn = ++engine.turns;
+        std::ostringstream text;
+        text << state << '\n';
+        auto data = std::make_shared<std::string>(text.str());
+        asio::async_write(engine.input, asio::buffer(*data), [this, index, game, data](const boost::system::error_code& ec, std::size_t) {
+            if (ec)
+                fail(index, game, "write: " + ec.message());
+        });
+        engine.timer.expires_after(std::chrono::milliseconds(settings.move_timeout));
+        engine.timer.async_wait([this, index, game, turn](const boost::system::error_code& ec) {
+            // 取り消されたか、手を読み終えた後に期限が来たものは無視する
+            if (!ec && engines[index]->turns == turn && engines[index]->busy)
+                fail(index, game, "no move within " + std::to_string(settings.move_timeout) + " ms");
+        });
+        asio::async_read_until(engine.output, engine.buffer, '\n', [this, index, game](const boost::system::error_code& ec, std::size_t) {
+            auto& engine = *engines[index];
+            if (engine.dead)
+                return;
+            if (ec)
+                return fail(index, game, "read: " + ec.message());
+            engine.timer.cancel();
+            std::string line;
+            std::getline(std::istream(&engine.buffer), line);
+            engine.busy = false;
+
+            std::istringstream in(line);
+            in.exceptions(std::ios_base::failbit);
+            Quoridor::State::NextMove m;
+            try {
+                in >> m;
+            } catch (std::exception&) {
+                finish(game, "unreadable move from the engine: " + line);
+                dispatch();
+                return;
+            }
+            auto reply = std::make_shared<std::string>(toServerMove(m, *game->flipped));
+            game->plies++;
+            asio::async_write(game->socket, asio::buffer(*reply), [this, game, reply](const boost::system::error_code& ec, std::size_t) {
+                if (ec)
+                    return finish(game, "send: " + ec.message());
+                readState(game);
+            });
+            dispatch();
+        });
+    }
+
+    /*!
+     * 応答しなくなったエンジンを終了させてプールから外し、そのエンジンが考えていた接続を閉じる。
+     * エンジンが1つも残らなければ、それ以上続けられないので終わる。
+     */
+    void fail(int index, const GamePtr& game, const std::string& text)
+    {
+        auto& engine = *engines[index];
+        if (engine.dead)
+            return;
+        std::cerr << "engine " << index << " failed: " << text << std::endl;
+        failed++;
+        engine.dead = true;
+        engine.busy = true;  // dispatchで選ばれないようにする
+        boost::system::error_code ec;
+        engine.timer.cancel();
+        engine.input.close(ec);
+        engine.output.close(ec);
+        engine.process.reset();
+        finish(game, "engine " + std::to_string(index) + " failed");
+        if (std::all_of(engines.begin(), engines.end(), [](const auto& e) { return e->dead; })) {
+            std::cerr << "no engines left" << std::endl;
+            io.stop();
+            return;
+        }
+        dispatch();
+    }
+
+    void finish(const GamePtr& game, const std::string& reason)
+    {
+        boost::system::error_code ec;
+        game->socket.close(ec);
+        log(game, "finished after " + std::to_string(game->plies) + " moves (" + reason + ")");
+        if (++finished >= settings.games) {
+            io.stop();
+            return;
+        }
+        connect();
+    }
+
+    asio::io_context& io;
+    const Settings settings;
+    tcp::resolver resolver;
+    std::vector<std::unique_ptr<Engine>> engines;
+    std::deque<std::pair<GamePtr, Quoridor::State>> queue;  //! エンジンが空くのを待っている手番
+    int started = 0;
+    int finished = 0;
+    int failed = 0;
+};
+}  // namespace
+
+int main(int argc, const char** argv)
+{
+    Bridge::Settings settings;
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            settings.port = argv[++i];
+        } else if (arg == "--connections" && i + 1 < argc) {
+            settings.connections = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--games" && i + 1 < argc) {
+            settings.games = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--engines" && i + 1 < argc) {
+            settings.engines = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--move-timeout" && i + 1 < argc) {
+            settings.move_timeout = std::max<int64_t>(1, std::stoll(argv[++i]));
+        } else if (arg == "--engine-stderr") {
+            settings.show_stderr = true;
+        } else if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+        } else {
+            positional.clear();
+            break;
+        }
+    }
+    if (positional.size() != 2) {
+        std::cerr << "Usage: tcp-bridge <server address> <engine command> [--port P] [--connections K] [--games N] [--engines E] [--move-timeout MS] [--engine-stderr]" << std::endl;
+        return 1;
+    }
+    settings.host = positional[0];
+    settings.engine_command = positional[1];
+    std::signal(SIGPIPE, SIG_IGN);  // 終了したエンジンや閉じた接続に書き込んでも落ちないようにする
+
+    asio::io_context io;
+    Bridge bridge(io, settings);
+    if (!bridge.start()) {
+        std::cerr << "cannot start the engine: " << settings.engine_command << std::endl;
+        return 1;
+    }
+    io.run();
+    return bridge.failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/*!
+ * 対局の持ち時間の決まり。時間は全てミリ秒。
+ */
+struct TimeControl {
+    int64_t move_time = 980;  //! 1手に使ってよい時間の上限。0なら上限なし
+    int64_t game_time = 0;    //! 1局全体の持ち時間。0なら持ち時間はなく、毎手move_timeを上限にして使う
+    int64_t increment = 0;    //! 1手指すごとに持ち時間に足される時間
+    int moves_to_go = 30;     //! 持ち時間を割り振るときの、残りの手数の見積もり
+    int64_t margin = 20;      //! 持ち時間から通信などの遅れに備えて残しておく時間
+
+    /*!
+     * argv[i]が持ち時間のオプションなら読み取ってiを進め、trueを返す。
+     * --movetime <ms>, --time <ms>, --inc <ms>, --moves-to-go <N>, --time-margin <ms>
+     */
+    bool parseOption(int& i, int argc, const char** argv)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return false;
+        if (arg == "--movetime") {
+            move_time = std::stoll(argv[++i]);
+        } else if (arg == "--time") {
+            game_time = std::stoll(argv[++i]);
+        } else if (arg == "--inc") {
+            increment = std::stoll(argv[++i]);
+        } else if (arg == "--moves-to-go") {
+            moves_to_go = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--time-margin") {
+            margin = std::stoll(argv[++i]);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static constexpr const char* USAGE = "[--movetime <ms>] [--time <ms>] [--inc <ms>] [--moves-to-go <N>] [--time-margin <ms>]";
+};
+
+/*!
+ * 1手に使う時間を決める。
+ * 手番の初めに、使う時間の目安(soft)と超えてはならない上限(hard)を決める。
+ * 持ち時間がなければ上限はmove_timeで、目安はその1/MOVE_TIME_RATIO。持ち時間があれば、残りの手数で割った時間を目安にする。
+ * 反復深化の1回が終わるたびにonIterationを呼ぶ。最善手が変わったり、評価値が2つ前の深さより下がったりしたら目安を延ばす。
+ * 目安を過ぎたか、前の深さからの伸び方で見積もった次の深さの探索が上限までに終わりそうになければ、次の深さを始めない。
+ * 探索中に上限を過ぎたかは、stopで時計をCHECK_INTERVAL回に1回だけ読んで調べる。
+ */
+class TimeManager
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr int CHECK_INTERVAL = 16;      //! stopが時計を読む間隔(呼ばれた回数)。stopは残り深さ2以上のノードでしか呼ばれないので小さめにする
+    static constexpr int64_t HARD_RATIO = 4;       //! 持ち時間があるとき、上限を目安の何倍までにするか
+    static constexpr int64_t MOVE_TIME_RATIO = 2;  //! 持ち時間がないとき、目安をmove_timeの何分の1にするか。目安を延ばす余地を残す
+    static constexpr double EXTENSION = 1.5;       //! 最善手が変わったか評価値が下がったとき、目安に掛ける
+    static constexpr double MAX_EXTENSION = 3.0;   //! 1手の間に目安を延ばす倍率の上限
+    static constexpr double MIN_GROWTH = 1.5;      //! 次の深さの時間の見積もりに使う、前の深さからの伸びの下限
+    static constexpr int64_t UNLIMITED = 24 * 60 * 60 * 1000;  //! 上限がないときの時間[ms]
+
+    /*!
+     * @param score_step 評価値の1歩分の大きさ。評価値がその半分以上下がったら目安を延ばす
+     */
+    TimeManager(const TimeControl& tc, int64_t score_step) : tc(tc), score_step(score_step), remaining(tc.game_time)
+    {
+    }
+
+    //! 手番の初めに呼ぶ
+    void startTurn()
+    {
+        start = Clock::now();
+        last_iteration_end = start;
+        expired = false;
+        int64_t hard_ms = tc.move_time > 0 ? tc.move_time : UNLIMITED;
+        int64_t soft_ms = tc.move_time > 0 ? tc.move_time / MOVE_TIME_RATIO : UNLIMITED;
+        if (tc.game_time > 0) {
+            const int64_t usable = std::max<int64_t>(0, remaining - tc.margin);
+            const int64_t base = usable / tc.moves_to_go + tc.increment;
+            soft_ms = std::min({hard_ms, base, usable});
+            hard_ms = std::min({hard_ms, base * HARD_RATIO, usable});
+        }
+        soft = std::chrono::milliseconds(soft_ms);
+        hard = std::chrono::milliseconds(hard_ms);
+        extension = 1.0;
+        calls = 0;
+        iterations = 0;
+        last_best_index = -1;
+        scores.fill(std::nullopt);
+    }
+
+    /*!
+     * 上限を過ぎていて、探索を打ち切るべきならtrue。探索の各ノードから呼ぶ。複数のスレッドから呼んでよい。
+     */
+    bool stop() const
+    {
+        if (expired.load(std::memory_order_relaxed))
+            return true;
+        if ((calls.fetch_add(1, std::memory_order_relaxed) + 1) % CHECK_INTERVAL != 0)
+            return false;
+        if (Clock::now() - start < hard)
+            return false;
+        expired.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    /*!
+     * 反復深化の深さdepthの探索が終わったら呼ぶ。次の深さを探索すべきならtrueを返す。
+     * @param best_index 最善手のインデックス(forEachMoveの列挙順)
+     */
+    bool onIteration(int depth, int best_index, int64_t score)
+    {
+        const auto now = Clock::now();
+        const auto took = now - last_iteration_end;
+        last_iteration_end = now;
+
+        if (iterations > 0 && best_index != last_best_index)
+            extend();
+        // 手番が変わるたびに評価値が上下しやすいので、2つ前の深さと比べる
+        if (depth >= 2 && depth < int(scores.size()) && scores[depth - 2] && score <= *scores[depth - 2] - score_step / 2)
+            extend();
+        if (depth < int(scores.size()))
+            scores[depth] = score;
+        last_best_index = best_index;
+
+        const auto elapsed = now - start;
+        bool next = elapsed < std::chrono::duration_cast<Clock::duration>(soft * extension);
+        if (next && iterations > 0 && last_took.count() > 0) {
+            const double growth = std::max(MIN_GROWTH, double(took.count()) / double(last_took.count()));
+            next = elapsed + std::chrono::duration_cast<Clock::duration>(took * growth) < hard;
+        }
+        last_took = took;
+        iterations++;
+        return next;
+    }
+
+    //! 手を指したら呼ぶ。持ち時間から使った時間を引く。
+    void endTurn()
+    {
+        if (tc.game_time > 0) {
+            remaining -= std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+            remaining += tc.increment;
+        }
+    }
+
+    //! この手番で探索を打ち切る時刻
+    Clock::time_point deadline() const
+    {
+        return start + std::chrono::duration_cast<Clock::duration>(hard);
+    }
+
+    //! 残りの持ち時間[ms]
+    int64_t remainingTime() const
+    {
+        return remaining;
+    }
+
+private:
+    void extend()
+    {
+        extension = std::min(MAX_EXTENSION, extension * EXTENSION);
+    }
+
+    const TimeControl tc;
+    const int64_t score_step;
+    int64_t remaining;  //! 残りの持ち時間[ms]
+
+    Clock::time_point start;
+    Clock::time_point last_iteration_end;
+    Clock::duration last_took{};  //! 前の深さの探索にかかった時間
+    std::chrono::duration<double, std::milli> soft{};
+    std::chrono::duration<double, std::milli> hard{};
+    double extension = 1.0;
+    int iterations = 0;
+    int last_best_index = -1;
+    std::array<std::optional<int64_t>, 64> scores;  //! この手番の深さごとの評価値
+    mutable std::atomic<bool> expired{false};
+    mutable std::atomic<int> calls{0};  //! stopが呼ばれた回数。このTimeManagerを使う全てのスレッドで数える
+};
@@ -0,0 +1,289 @@
+#include "evaluator.hpp"
+#include "match_utils.hpp"
+#include "negaalpha.hpp"
+#include "quoridor_fast.hpp"
+#include "time_manager.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * 設定の違うnegascout-fast同士を同じプロセスの中で対局させ、勝率とEloの差を出す。
+ * judge.shのようにパイプとテキストの盤面を介さず、QuoridorFast::Stateのまま手を進める。
+ * 対局はスレッドの数だけ並列に行い、各スレッドは両方のエンジンの置換表と探索状態を自分で持つ。
+ * 開始局面は初期局面からランダムな手をopening-plies手進めたもので、同じ開始局面を先手を入れ替えて2局ずつ指す。
+ * 手の数がmax-pliesに達したら引き分けにする。
+ *
+ * Usage: tournament [--games N] [--threads N] [--opening-plies N] [--max-plies N] [--seed S] <エンジンA> <エンジンB>
+ * エンジンは "キー=値" をカンマで区切って指定する。空文字列なら全て既定値。
+ *   nodes=N       1手あたりのノード数の上限(既定は20000)。movetimeを指定したら既定はなし
+ *   movetime=MS   1手あたりの時間の上限
+ *   depth=D       反復深化の最大の深さ(既定は20)
+ *   lmr=0|1(既定は0), lmr-moves=K, lmr-table=BASE:DIVISOR, aspiration=W, hash=MB(既定は8)
+ */
+
+namespace
+{
+using Match::Outcome;
+
+struct EngineConfig {
+    std::string spec;
+    int max_depth = 20;
+    uint64_t nodes = 20000;  //! 1手あたりのノード数の上限。0なら上限なし
+    int64_t move_time = 0;   //! 1手あたりの時間の上限[ms]。0なら上限なし
+    LateMoveReduction lmr;
+    std::optional<TScore> aspiration_window;
+    std::size_t hash_mb = 8;
+
+    //! 設定の文字列を読む。読めなければエラーを出力してstd::nullopt
+    static std::optional<EngineConfig> parse(const std::string& spec)
+    {
+        EngineConfig config;
+        config.spec = spec.empty() ? "default" : spec;
+        bool nodes_given = false;
+        std::istringstream in(spec);
+        std::string item;
+        while (std::getline(in, item, ',')) {
+            if (item.empty())
+                continue;
+            const auto eq = item.find('=');
+            const std::string key = item.substr(0, eq);
+            const std::string value = eq == std::string::npos ? "" : item.substr(eq + 1);
+            try {
+                if (key == "nodes") {
+                    config.nodes = std::stoull(value);
+                    nodes_given = true;
+                } else if (key == "movetime") {
+                    config.move_time = std::stoll(value);
+                } else if (key == "depth") {
+                    config.max_depth = std::clamp(std::stoi(value), 1, MAX_DEPTH - 1);
+                } else if (key == "lmr") {
+                    config.lmr.enabled = std::stoi(value) != 0;
+                } else if (key == "lmr-moves") {
+                    config.lmr.min_moves = std::stoi(value);
+                } else if (key == "lmr-table") {
+                    const auto colon = value.find(':');
+                    config.lmr.setTable(std::stod(value.substr(0, colon)), std::stod(value.substr(colon + 1)));
+                } else if (key == "aspiration") {
+                    config.aspiration_window = std::stoi(value);
+                } else if (key == "hash") {
+                    config.hash_mb = std::stoul(value);
+                } else {
+                    std::cerr << "unknown engine option: " << key << std::endl;
+                    return std::nullopt;
+                }
+            } catch (std::exception&) {
+                std::cerr << "bad value for " << key << ": " << value << std::endl;
+                return std::nullopt;
+            }
+        }
+        if (config.move_time > 0 && !nodes_given)
+            config.nodes = 0;
+        return config;
+    }
+};
+
+/*!
+ * 1つのスレッドで対局するエンジン。置換表と探索状態は対局ごとに空にする。
+ */
+class Player
+{
+public:
+    uint64_t moves = 0;        //! 指した手の数
+    uint64_t depth_sum = 0;    //! 探索し終えた深さの合計
+    uint64_t nodes_sum = 0;    //! 探索したノード数の合計
+
+    explicit Player(const EngineConfig& config)
+        : config(config), table(config.hash_mb), time_manager(timeControl(config), QuoridorFast::default_weights.step)
+    {
+    }
+
+    void newGame()
+    {
+        table.clear();
+        ctx = std::make_unique<SearchContext<QuoridorFast::State>>();
+        ctx->table = &table;
+        ctx->lmr = config.lmr;
+        if (config.aspiration_window)
+            ctx->aspiration_window = *config.aspiration_window;
+    }
+
+    QuoridorFast::State::NextMove think(const QuoridorFast::State& s)
+    {
+        table.newTurn();
+        time_manager.startTurn();
+        const uint64_t start_nodes = ctx->nodes;
+        auto stop = [&] {
+            return (config.nodes > 0 && ctx->nodes - start_nodes >= config.nodes) || (config.move_time > 0 && time_manager.stop());
+        };
+        Result<QuoridorFast::State> res = {};
+        int completed = 0;
+        // 深さ1は打ち切られないので、必ず手が決まる
+        for (int depth = 1; depth <= config.max_depth; depth++) {
+            auto current = iterativeDeepeningNegascout(*ctx, s, eval, depth, depth - 1, stop);
+            if (current.aborted) {
+                if (current.hasMove())
+                    res = current;
+                break;
+            }
+            res = current;
+            completed = depth;
+            if (config.move_time > 0 && !time_manager.onIteration(depth, ctx->best_path_table[0][0], res.score))
+                break;
+        }
+        moves++;
+        depth_sum += completed;
+        nodes_sum += ctx->nodes - start_nodes;
+        return res.getMove();
+    }
+
+private:
+    static TimeControl timeControl(const EngineConfig& config)
+    {
+        TimeControl tc;
+        tc.move_time = config.move_time;
+        return tc;
+    }
+
+    const EngineConfig& config;
+    const QuoridorFast::Evaluate eval{};
+    HashTable<QuoridorFast::State> table;
+    TimeManager time_manager;
+    std::unique_ptr<SearchContext<QuoridorFast::State>> ctx;
+};
+
+//! sから先手first、後手secondで対局する。反則の手を指したら負け
+Outcome playGame(Player& first, Player& second, QuoridorFast::State s, int max_plies)
+{
+    first.newGame();
+    second.newGame();
+    Player* players[2] = {&first, &second};
+    for (int ply = 0; ply < max_plies; ply++) {
+        const bool first_to_move = ply % 2 == 0;
+        auto next = s.move(players[ply % 2]->think(s));
+        if (!next)
+            return first_to_move ? Outcome::SecondWins : Outcome::FirstWins;
+        s = *next;
+        // sは次に指す側から見た局面なので、lose()なら今指した側の勝ち
+        if (s.lose())
+            return first_to_move ? Outcome::FirstWins : Outcome::SecondWins;
+    }
+    return Outcome::Draw;
+}
+}  // namespace
+
+int main(int argc, const char** argv)
+{
+    int games = 1000;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    int opening_plies = 4;
+    int max_plies = 200;
+    uint64_t seed = 1;
+    std::vector<std::string> specs;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--games" && i + 1 < argc) {
+            games = std::max(2, std::stoi(argv[++i]));
+        } else if (arg == "--threads" && i + 1 < argc) {
+            threads = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--opening-plies" && i + 1 < argc) {
+            opening_plies = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--max-plies" && i + 1 < argc) {
+            max_plies = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (arg.rfind("--", 0) != 0) {
+            specs.push_back(arg);
+        } else {
+            specs.clear();
+            break;
+        }
+    }
+    if (specs.size() != 2) {
+        std::cerr << "Usage: tournament [--games N] [--threads N] [--opening-plies N] [--max-plies N] [--seed S] <engine A> <engine B>\n"
+                     "  engine: comma separated key=value (nodes, movetime, depth, lmr, lmr-moves, lmr-table=base:divisor, aspiration, hash)"
+                  << std::endl;
+        return 1;
+    }
+    const auto engine_a = EngineConfig::parse(specs[0]);
+    const auto engine_b = EngineConfig::parse(specs[1]);
+    if (!engine_a || !engine_b)
+        return 1;
+    games += games % 2;  // 開始局面ごとに先手を入れ替えて2局指す
+
+    std::cout << "A: " << engine_a->spec << "\nB: " << engine_b->spec << '\n'
+              << "Games: " << games << ", threads: " << threads << ", opening plies: " << opening_plies << ", max plies: " << max_plies << ", seed: " << seed << std::endl;
+
+    std::mutex mutex;
+    int wins = 0, losses = 0, draws = 0;  // Aから見た結果
+    uint64_t moves[2] = {}, depth_sum[2] = {}, nodes_sum[2] = {};
+    std::atomic<int> next_game{0};
+    const int report_interval = std::max(1, games / 20);
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&] {
+        Player a(*engine_a), b(*engine_b);
+        for (int g; (g = next_game++) < games;) {
+            const QuoridorFast::State opening = Match::randomOpening(Match::openingSeed(seed, uint64_t(g / 2)), opening_plies);
+            const bool a_first = g % 2 == 0;
+            const Outcome outcome = a_first ? playGame(a, b, opening, max_plies) : playGame(b, a, opening, max_plies);
+
+            std::lock_guard lock{mutex};
+            if (outcome == Outcome::Draw) {
+                draws++;
+            } else if ((outcome == Outcome::FirstWins) == a_first) {
+                wins++;
+            } else {
+                losses++;
+            }
+            const int played = wins + losses + draws;
+            if (played % report_interval == 0 || played == games) {
+                std::cerr << "  " << played << "/" << games << ": +" << wins << " -" << losses << " =" << draws << std::endl;
+            }
+        }
+        std::lock_guard lock{mutex};
+        moves[0] += a.moves, depth_sum[0] += a.depth_sum, nodes_sum[0] += a.nodes_sum;
+        moves[1] += b.moves, depth_sum[1] += b.depth_sum, nodes_sum[1] += b.nodes_sum;
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& th : pool) {
+        th.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // 1局ごとの得点(勝ち1、引き分け0.5、負け0)の平均と標準誤差から、Eloの差と95%の信頼区間を出す
+    const double n = wins + losses + draws;
+    const double score = (wins + 0.5 * draws) / n;
+    const double variance = (wins * std::pow(1 - score, 2) + draws * std::pow(0.5 - score, 2) + losses * std::pow(score, 2)) / n;
+    const double error = 1.96 * std::sqrt(variance / n);
+    const double elo = Match::eloFromScore(score);
+    const double elo_low = Match::eloFromScore(score - error), elo_high = Match::eloFromScore(score + error);
+    const double los = wins + losses == 0 ? 0.5 : 0.5 * (1 + std::erf((wins - losses) / std::sqrt(2.0 * (wins + losses))));
+
+    std::cout << std::fixed << std::setprecision(1);
+    for (int e = 0; e < 2; e++) {
+        std::cout << (e == 0 ? "A" : "B") << ": average depth " << double(depth_sum[e]) / double(std::max<uint64_t>(1, moves[e]))
+                  << ", nodes/move " << std::setprecision(0) << double(nodes_sum[e]) / double(std::max<uint64_t>(1, moves[e])) << std::setprecision(1) << '\n';
+    }
+    std::cout << "A wins " << wins << ", B wins " << losses << ", draws " << draws << '\n'
+              << "Score of A: " << 100 * score << "% +- " << 100 * error << "%\n"
+              << "Elo difference: " << elo << " +- " << (elo_high - elo_low) / 2 << " (95%: " << elo_low << " .. " << elo_high << ")\n"
+              << "LOS: " << 100 * los << "%\n"
+              << "Time: " << seconds << " s (" << std::setprecision(2) << n / seconds << " games/s)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,162 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+ * ワークスティーリングするスレッドプール。
+ * ワーカー0は呼び出し側のスレッドで、runOne()を呼んだときだけタスクを実行する。
+ * 各ワーカーは自分のキューの後ろからタスクを取り、空なら他のワーカーのキューの前から盗む。
+ * タスクにはタグ(ポインタ)をつけることができ、runOne()で実行するタスクをタグで選べる。
+ * 探索の途中でタスクを出し入れしてもヒープ確保しないよう、タスクは関数ポインタと引数だけを持ち、キューは容量を確保しておく。
+ */
+class WorkStealingPool
+{
+public:
+    /*!
+     * タスク。contextの指す関数オブジェクトを(ワーカー, index)で呼ぶ。
+     * contextはタスクを実行し終えるまで、タスクを入れた側が生かしておく。
+     */
+    struct Task {
+        void (*run)(void* context, int index, int worker) = nullptr;
+        void* context = nullptr;
+        int index = 0;
+
+        //! f(worker, index)を呼ぶタスク
+        template <class F>
+        static Task of(F& f, int index)
+        {
+            return {[](void* context, int index, int worker) { (*static_cast<F*>(context))(worker, index); }, &f, index};
+        }
+
+        explicit operator bool() const
+        {
+            return run != nullptr;
+        }
+        void operator()(int worker) const
+        {
+            run(context, index, worker);
+        }
+    };
+
+    explicit WorkStealingPool(int threads) : queues(std::max(1, threads))
+    {
+        for (int i = 1; i < size(); i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard lock{sleep_mutex};
+            shutdown = true;
+        }
+        sleep_cv.notify_all();
+        for (auto& th : workers) {
+            th.join();
+        }
+    }
+
+    int size() const
+    {
+        return int(queues.size());
+    }
+
+    void push(int worker, const void* tag, Task task)
+    {
+        {
+            std::lock_guard lock{queues[worker].mutex};
+            queues[worker].tasks.push_back({tag, task});
+        }
+        queued++;
+        sleep_cv.notify_one();
+    }
+
+    /*!
+     * acceptがtrueを返すタグのタスクを一つ探して実行する。
+     * @return 実行したらtrue
+     */
+    template <class FAccept>
+    bool runOne(int worker, const FAccept& accept)
+    {
+        if (queued.load(std::memory_order_relaxed) == 0)
+            return false;
+        Task task;
+        if (!take(worker, true, accept, task)) {
+            for (int i = 1; i < size(); i++) {
+                if (take((worker + i) % size(), false, accept, task))
+                    break;
+            }
+        }
+        if (!task)
+            return false;
+        queued--;
+        task(worker);
+        return true;
+    }
+
+private:
+    struct Entry {
+        const void* tag;
+        Task task;
+    };
+    struct Queue {
+        static constexpr std::size_t INITIAL_CAPACITY = 1024;  //! これを超えたときだけ確保し直す
+
+        std::mutex mutex;
+        std::vector<Entry> tasks;
+
+        Queue()
+        {
+            tasks.reserve(INITIAL_CAPACITY);
+        }
+    };
+
+    template <class FAccept>
+    bool take(int victim, bool own, const FAccept& accept, Task& out)
+    {
+        Queue& q = queues[victim];
+        std::lock_guard lock{q.mutex};
+        if (own) {
+            for (auto it = q.tasks.rbegin(); it != q.tasks.rend(); ++it) {
+                if (accept(it->tag)) {
+                    out = it->task;
+                    q.tasks.erase(std::next(it).base());
+                    return true;
+                }
+            }
+        } else {
+            for (auto it = q.tasks.begin(); it != q.tasks.end(); ++it) {
+                if (accept(it->tag)) {
+                    out = it->task;
+                    q.tasks.erase(it);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int id)
+    {
+        while (true) {
+            if (runOne(id, [](const void*) { return true; }))
+                continue;
+            std::unique_lock lock{sleep_mutex};
+            if (shutdown)
+                return;
+            sleep_cv.wait_for(lock, std::chrono::milliseconds(1), [&] { return shutdown || queued.load() > 0; });
+        }
+    }
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> queued{0};
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool shutdown = false;
+};